@@ -0,0 +1,98 @@
+/*
+ *	The PCI Utilities -- Create a Compiled Copy of the ID List
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "pciutils.h"
+
+const char program_name[] = "compile-pciids";
+
+static int failed, debugging;
+
+static void PCI_PRINTF(1,2)
+compile_warning(char *msg, ...)
+{
+  va_list args;
+
+  va_start(args, msg);
+  fprintf(stderr, "%s: ", program_name);
+  vfprintf(stderr, msg, args);
+  fputc('\n', stderr);
+  va_end(args);
+  failed = 1;
+}
+
+static void PCI_PRINTF(1,2)
+compile_debug(char *msg, ...)
+{
+  va_list args;
+
+  if (!debugging)
+    return;
+  va_start(args, msg);
+  vfprintf(stdout, msg, args);
+  va_end(args);
+}
+
+static const char help_msg[] =
+"Usage: compile-pciids [<options>]\n"
+"\n"
+"-i <file>\tUse specified ID database instead of %s\n"
+"-G\t\tPrint debugging messages\n";
+
+int
+main(int argc, char **argv)
+{
+  struct pci_access *pacc;
+  int i;
+
+  if (argc == 2 && !strcmp(argv[1], "--version"))
+    {
+      puts("compile-pciids version " PCIUTILS_VERSION);
+      return 0;
+    }
+
+  pacc = pci_alloc();
+  pacc->warning = compile_warning;
+  pacc->debug = compile_debug;
+
+  while ((i = getopt(argc, argv, "i:G")) != -1)
+    switch (i)
+      {
+      case 'i':
+	pci_set_name_list_path(pacc, optarg, 0);
+	break;
+      case 'G':
+	debugging++;
+	break;
+      default:
+	fprintf(stderr, help_msg, pacc->id_file_name);
+	return 1;
+      }
+  if (optind < argc)
+    {
+      fprintf(stderr, help_msg, pacc->id_file_name);
+      return 1;
+    }
+
+  /* Always parse the text list and write a fresh copy next to it */
+  if (pci_set_param(pacc, "names.compiled", "0") < 0 ||
+      pci_set_param(pacc, "names.compiled_update", "1") < 0)
+    die("Compiled ID lists are not supported on this system");
+  pci_set_param(pacc, "names.shared_cache", "");
+  pci_set_param(pacc, "names.lazy", "0");
+
+  if (!pci_load_name_list(pacc))
+    die("Cannot open %s", pacc->id_file_name);
+
+  pci_cleanup(pacc);
+  return failed;
+}
@@ -57,6 +57,27 @@ pci_link_dev(struct pci_access *a, struct pci_dev *d)
   return 1;
 }
 
+void
+pci_unlink_dev(struct pci_access *a, struct pci_dev *d)
+{
+  struct pci_dev **dd, *p;
+
+  for (dd = &a->devices; *dd; dd = &(*dd)->next)
+    if (*dd == d)
+      {
+	*dd = d->next;
+	break;
+      }
+
+  /* Children must not point to the device any longer */
+  for (p = a->devices; p; p = p->next)
+    if (p->parent == d)
+      {
+	p->parent = NULL;
+	p->known_fields &= ~PCI_FILL_PARENT;
+      }
+}
+
 struct pci_dev *
 pci_get_dev(struct pci_access *a, int domain, int bus, int dev, int func)
 {
@@ -132,6 +153,76 @@ pci_read_block(struct pci_dev *d, int pos, byte *buf, int len)
   return d->methods->read(d, pos, buf, len);
 }
 
+int
+pci_read_blocks(struct pci_access *a, struct pci_read_request *req, int n)
+{
+  struct pci_read_request *r, *rest;
+  struct pci_dev *d;
+  int i, m, l, *map, ok = 0;
+
+  if (!n)
+    return 0;
+
+  /* Serve whatever the config space caches have, submit only the rest */
+  rest = pci_malloc(a, n * sizeof(struct pci_read_request));
+  map = pci_malloc(a, n * sizeof(int));
+  for (i=m=0; i<n; i++)
+    {
+      r = &req[i];
+      d = r->dev;
+      l = 0;
+      if (r->pos >= 0 && r->pos < d->cache_len)
+	{
+	  l = (r->pos + r->len > d->cache_len) ? (d->cache_len - r->pos) : r->len;
+	  memcpy(r->buf, d->cache + r->pos, l);
+	}
+      if (l == r->len)
+	{
+	  r->status = 1;
+	  ok++;
+	  continue;
+	}
+      rest[m] = *r;
+      rest[m].pos += l;
+      rest[m].buf += l;
+      rest[m].len -= l;
+      map[m++] = i;
+    }
+
+  if (a->methods->read_blocks && m)
+    a->methods->read_blocks(a, rest, m);
+  else
+    for (i=0; i<m; i++)
+      rest[i].status = pci_read_block(rest[i].dev, rest[i].pos, rest[i].buf, rest[i].len);
+  for (i=0; i<m; i++)
+    {
+      req[map[i]].status = rest[i].status;
+      ok += rest[i].status;
+    }
+
+  pci_mfree(map);
+  pci_mfree(rest);
+  return ok;
+}
+
+int
+pci_hotplug_open(struct pci_access *a)
+{
+  return a->methods->hotplug_open ? a->methods->hotplug_open(a) : -1;
+}
+
+int
+pci_rescan_incremental(struct pci_access *a)
+{
+  return a->methods->rescan ? a->methods->rescan(a) : -1;
+}
+
+int
+pci_hotplug_event(struct pci_access *a, const char *msg, int len)
+{
+  return a->methods->hotplug_event ? a->methods->hotplug_event(a, msg, len) : -1;
+}
+
 int
 pci_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
 {
@@ -179,7 +270,7 @@ pci_write_block(struct pci_dev *d, int pos, byte *buf, int len)
   return d->methods->write(d, pos, buf, len);
 }
 
-static void
+void
 pci_reset_properties(struct pci_dev *d)
 {
   d->known_fields = 0;
@@ -204,6 +295,20 @@ pci_fill_info_v313(struct pci_dev *d, int flags)
   return d->known_fields;
 }
 
+void
+pci_prefetch_info(struct pci_access *a, struct pci_dev **devs, int n, int flags)
+{
+  int i;
+
+  if (n <= 0)
+    return;
+  if (a->methods->prefetch_info)
+    a->methods->prefetch_info(a, devs, n, flags);
+  else
+    for (i=0; i<n; i++)
+      pci_fill_info_v313(devs[i], flags);
+}
+
 /* In version 3.1, pci_fill_info got new flags => versioned alias */
 /* In versions 3.2, 3.3, 3.4, 3.5, 3.8 and 3.12, the same has happened */
 STATIC_ALIAS(int pci_fill_info(struct pci_dev *d, int flags), pci_fill_info_v313(d, flags));
@@ -19,6 +19,10 @@
 #include <string.h>
 #include <limits.h>
 
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #ifndef PCI_OS_WINDOWS
 #include <glob.h>
 #include <unistd.h>
@@ -84,6 +88,12 @@ struct acpi_mcfg {
   } allocations[0];
 } PCI_PACKED;
 
+/*
+ * Mapped ECAM windows of individual buses are kept in a cache, so that scans
+ * alternating between buses (e.g., recursing behind bridges) do not have to
+ * map and unmap them over and over. The cache holds at most ecam.cache windows
+ * and when it is full, the least recently used one is unmapped.
+ */
 struct mmap_cache {
   void *map;
   u64 addr;
@@ -91,12 +101,27 @@ struct mmap_cache {
   int domain;
   u8 bus;
   int w;
+  struct mmap_cache *lru_prev, *lru_next;
+  struct mmap_cache *hash_next;
+};
+
+#define MMAP_HASH_SIZE 256
+
+struct mmap_lru {
+  struct mmap_cache *first, *last;	/* Most recently used first */
+  struct mmap_cache *hash[MMAP_HASH_SIZE];
+  int count, max;
+  unsigned int hits, misses, evictions;
 };
 
 // Back-end data linked to struct pci_access
 struct ecam_access {
   struct acpi_mcfg *mcfg;
-  struct mmap_cache *cache;
+  struct mmap_lru lru;
+#ifdef PCI_HAVE_PTHREADS
+  int threaded;				/* ecam_scan() runs in multiple threads, each having its own LRU */
+  pthread_key_t lru_key;
+#endif
   struct physmem *physmem;
   long pagesize;
 };
@@ -790,26 +815,104 @@ get_bus_addr(struct acpi_mcfg *mcfg, const char *addrs, int domain, u8 bus, u64
 }
 
 static void
-munmap_reg(struct pci_access *a)
+init_mmap_lru(struct mmap_lru *lru, int max)
 {
-  struct ecam_access *eacc = a->backend_data;
-  struct mmap_cache *cache = eacc->cache;
-  struct physmem *physmem = eacc->physmem;
-  long pagesize = eacc->pagesize;
+  memset(lru, 0, sizeof(*lru));
+  lru->max = max;
+}
+
+static void
+init_mmap_cache(struct pci_access *a, struct ecam_access *eacc)
+{
+  const char *param = pci_get_param(a, "ecam.cache");
+  int max = atoi(param);
+
+  if (max < 1)
+    {
+      a->warning("Invalid ecam.cache value %s, using 1", param);
+      max = 1;
+    }
+  init_mmap_lru(&eacc->lru, max);
+#ifdef PCI_HAVE_PTHREADS
+  eacc->threaded = 0;
+#endif
+}
+
+static inline struct mmap_lru *
+get_mmap_lru(struct ecam_access *eacc)
+{
+#ifdef PCI_HAVE_PTHREADS
+  if (eacc->threaded)
+    return pthread_getspecific(eacc->lru_key);
+#endif
+  return &eacc->lru;
+}
+
+static inline unsigned int
+mmap_hash(int domain, u8 bus)
+{
+  return ((unsigned int) domain * 0x9e3779b1 + bus) % MMAP_HASH_SIZE;
+}
 
-  if (!cache)
-    return;
+static void
+mmap_unlink(struct mmap_lru *lru, struct mmap_cache *cache)
+{
+  struct mmap_cache **cp;
+
+  if (cache->lru_prev)
+    cache->lru_prev->lru_next = cache->lru_next;
+  else
+    lru->first = cache->lru_next;
+  if (cache->lru_next)
+    cache->lru_next->lru_prev = cache->lru_prev;
+  else
+    lru->last = cache->lru_prev;
 
-  physmem_unmap(physmem, cache->map, cache->length + (cache->addr & (pagesize-1)));
+  for (cp = &lru->hash[mmap_hash(cache->domain, cache->bus)]; *cp != cache; cp = &(*cp)->hash_next)
+    ;
+  *cp = cache->hash_next;
+  lru->count--;
+}
+
+static void
+mmap_insert(struct mmap_lru *lru, struct mmap_cache *cache)
+{
+  unsigned int h = mmap_hash(cache->domain, cache->bus);
+
+  cache->lru_prev = NULL;
+  cache->lru_next = lru->first;
+  if (lru->first)
+    lru->first->lru_prev = cache;
+  else
+    lru->last = cache;
+  lru->first = cache;
+
+  cache->hash_next = lru->hash[h];
+  lru->hash[h] = cache;
+  lru->count++;
+}
+
+static void
+munmap_one(struct ecam_access *eacc, struct mmap_lru *lru, struct mmap_cache *cache)
+{
+  mmap_unlink(lru, cache);
+  physmem_unmap(eacc->physmem, cache->map, cache->length + (cache->addr & (eacc->pagesize-1)));
   pci_mfree(cache);
-  eacc->cache = NULL;
+}
+
+static void
+munmap_all(struct ecam_access *eacc, struct mmap_lru *lru)
+{
+  while (lru->first)
+    munmap_one(eacc, lru, lru->first);
 }
 
 static int
 mmap_reg(struct pci_access *a, int w, int domain, u8 bus, u8 dev, u8 func, int pos, volatile void **reg)
 {
   struct ecam_access *eacc = a->backend_data;
-  struct mmap_cache *cache = eacc->cache;
+  struct mmap_lru *lru = get_mmap_lru(eacc);
+  struct mmap_cache *cache = lru->first;
   struct physmem *physmem = eacc->physmem;
   long pagesize = eacc->pagesize;
   const char *addrs;
@@ -818,14 +921,25 @@ mmap_reg(struct pci_access *a, int w, int domain, u8 bus, u8 dev, u8 func, int p
   u32 length;
   u32 offset;
 
-  if (cache && cache->domain == domain && cache->bus == bus && !!cache->w == !!w)
+  /* Most accesses go to the same bus as the previous one */
+  if (!cache || cache->domain != domain || cache->bus != bus)
     {
-      map = cache->map;
-      addr = cache->addr;
-      length = cache->length;
+      for (cache = lru->hash[mmap_hash(domain, bus)]; cache; cache = cache->hash_next)
+        if (cache->domain == domain && cache->bus == bus)
+          break;
+      if (cache)
+        {
+          mmap_unlink(lru, cache);
+          mmap_insert(lru, cache);
+        }
     }
+
+  /* A writable mapping serves reads, too */
+  if (cache && (cache->w || !w))
+    lru->hits++;
   else
     {
+      lru->misses++;
       addrs = pci_get_param(a, "ecam.addrs");
       if (!get_bus_addr(eacc->mcfg, addrs, domain, bus, &addr, &length))
         return 0;
@@ -835,18 +949,27 @@ mmap_reg(struct pci_access *a, int w, int domain, u8 bus, u8 dev, u8 func, int p
         return 0;
 
       if (cache)
-        physmem_unmap(physmem, cache->map, cache->length + (cache->addr & (pagesize-1)));
-      else
-        cache = eacc->cache = pci_malloc(a, sizeof(*cache));
+        munmap_one(eacc, lru, cache);
+      else if (lru->count >= lru->max)
+        {
+          munmap_one(eacc, lru, lru->last);
+          lru->evictions++;
+        }
 
+      cache = pci_malloc(a, sizeof(*cache));
       cache->map = map;
       cache->addr = addr;
       cache->length = length;
       cache->domain = domain;
       cache->bus = bus;
       cache->w = w;
+      mmap_insert(lru, cache);
     }
 
+  map = cache->map;
+  addr = cache->addr;
+  length = cache->length;
+
   /*
    * Enhanced Configuration Access Mechanism (ECAM) offset according to:
    * PCI Express Base Specification, Revision 5.0, Version 1.0, Section 7.2.2, Table 7-1, p. 677
@@ -860,6 +983,27 @@ mmap_reg(struct pci_access *a, int w, int domain, u8 bus, u8 dev, u8 func, int p
   return 1;
 }
 
+/* Every window takes up to 1 MB of address space, which is scarce on 32-bit systems */
+#define ECAM_CACHE_DEFAULT (sizeof(void *) > 4 ? "256" : "16")
+
+/*
+ * Pointer to the config space of all functions on a bus, so that the generic
+ * scan can probe devices by plain loads. Valid until another bus is mapped.
+ */
+static volatile void *
+ecam_map_bus(struct pci_access *a, int domain, int bus)
+{
+  struct ecam_access *eacc = a->backend_data;
+  volatile void *reg;
+
+  if (!mmap_reg(a, 0, domain, bus, 0, 0, 0, &reg))
+    return NULL;
+  /* Windows of partial buses are left to the checks in ecam_read() */
+  if (get_mmap_lru(eacc)->first->length < 32*8*4096)
+    return NULL;
+  return reg;
+}
+
 static void
 ecam_config(struct pci_access *a)
 {
@@ -873,6 +1017,10 @@ ecam_config(struct pci_access *a)
   pci_define_param(a, "ecam.x86bios", "1", "Scan x86 BIOS memory for ACPI MCFG table");
 #endif
   pci_define_param(a, "ecam.addrs", "", "Physical addresses of memory mapped PCIe ECAM interface"); /* format: [domain:]start_bus[-end_bus]:start_addr[+length],... */
+  pci_define_param(a, "ecam.cache", ECAM_CACHE_DEFAULT, "Number of buses to keep ECAM windows mapped for");
+#ifdef PCI_HAVE_PTHREADS
+  pci_define_param(a, "ecam.threads", "1", "Number of threads scanning PCI segments in parallel (0=one per CPU)");
+#endif
 }
 
 static int
@@ -992,7 +1140,7 @@ ecam_detect(struct pci_access *a)
         }
 
       eacc->mcfg = NULL;
-      eacc->cache = NULL;
+      init_mmap_cache(a, eacc);
       a->backend_data = eacc;
       eacc->mcfg = find_mcfg(a, acpimcfg, efisystab, use_bsd, use_x86bios);
       if (!eacc->mcfg)
@@ -1048,7 +1196,7 @@ ecam_init(struct pci_access *a)
 
       eacc = pci_malloc(a, sizeof(*eacc));
       eacc->mcfg = NULL;
-      eacc->cache = NULL;
+      init_mmap_cache(a, eacc);
       eacc->physmem = physmem;
       eacc->pagesize = pagesize;
       a->backend_data = eacc;
@@ -1085,20 +1233,147 @@ ecam_cleanup(struct pci_access *a)
 {
   struct ecam_access *eacc = a->backend_data;
 
-  munmap_reg(a);
+  munmap_all(eacc, &eacc->lru);
+  if (eacc->lru.hits || eacc->lru.misses)
+    a->debug("ecam: mapping cache: %u hits, %u misses, %u evictions\n", eacc->lru.hits, eacc->lru.misses, eacc->lru.evictions);
   physmem_close(eacc->physmem);
   pci_mfree(eacc->mcfg);
   pci_mfree(eacc);
   a->backend_data = NULL;
 }
 
+#ifdef PCI_HAVE_PTHREADS
+
+/*
+ * Segments are independent of each other, so they can be scanned in parallel
+ * if enabled by the ecam.threads parameter. Each thread has its own mapping
+ * cache and collects the devices of each segment to a private list. The lists
+ * are linked to a->devices in the order of segments afterwards, so the result
+ * is the same as that of a serial scan.
+ */
+
+struct ecam_scan_state {
+  struct pci_access *a;
+  int *domains;
+  struct pci_dev **lists;
+  int n, next;
+  pthread_mutex_t lock;
+};
+
+static void *
+ecam_scan_worker(void *arg)
+{
+  struct ecam_scan_state *st = arg;
+  struct ecam_access *eacc = st->a->backend_data;
+  struct mmap_lru lru;
+  int i;
+
+  init_mmap_lru(&lru, eacc->lru.max);
+  pthread_setspecific(eacc->lru_key, &lru);
+  for (;;)
+    {
+      pthread_mutex_lock(&st->lock);
+      i = st->next++;
+      pthread_mutex_unlock(&st->lock);
+      if (i >= st->n)
+        break;
+      pci_generic_scan_domain_to(st->a, st->domains[i], &st->lists[i]);
+    }
+  munmap_all(eacc, &lru);
+
+  pthread_mutex_lock(&st->lock);
+  eacc->lru.hits += lru.hits;
+  eacc->lru.misses += lru.misses;
+  eacc->lru.evictions += lru.evictions;
+  pthread_mutex_unlock(&st->lock);
+  return NULL;
+}
+
+static int
+ecam_scan_parallel(struct pci_access *a, int *domains, int n)
+{
+  struct ecam_access *eacc = a->backend_data;
+  struct ecam_scan_state st;
+  struct pci_dev *d, *next, *rev;
+  pthread_t *threads;
+  int *started;
+  int i, nthreads = atoi(pci_get_param(a, "ecam.threads"));
+
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads > 64)
+    nthreads = 64;
+  if (nthreads <= 1)
+    return 0;
+
+  a->debug("ecam: scanning %d segments in %d threads\n", n, nthreads);
+  st.a = a;
+  st.domains = domains;
+  st.lists = pci_malloc(a, n * sizeof(struct pci_dev *));
+  memset(st.lists, 0, n * sizeof(struct pci_dev *));
+  st.n = n;
+  st.next = 0;
+  pthread_mutex_init(&st.lock, NULL);
+  threads = pci_malloc(a, nthreads * sizeof(pthread_t));
+  started = pci_malloc(a, nthreads * sizeof(int));
+
+  pthread_key_create(&eacc->lru_key, NULL);
+  eacc->threaded = 1;
+
+  /* We are one of the workers, too */
+  for (i=1; i<nthreads; i++)
+    started[i] = !pthread_create(&threads[i], NULL, ecam_scan_worker, &st);
+  ecam_scan_worker(&st);
+  for (i=1; i<nthreads; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+
+  eacc->threaded = 0;
+  pthread_key_delete(eacc->lru_key);
+
+  /* Private lists are in reverse order of discovery, just like a->devices */
+  for (i=0; i<n; i++)
+    {
+      for (rev = NULL, d = st.lists[i]; d; d = next)
+        {
+          next = d->next;
+          d->next = rev;
+          rev = d;
+        }
+      for (d = rev; d; d = next)
+        {
+          next = d->next;
+          pci_link_dev(a, d);
+        }
+    }
+
+  pthread_mutex_destroy(&st.lock);
+  pci_mfree(started);
+  pci_mfree(threads);
+  pci_mfree(st.lists);
+  return 1;
+}
+
+#else
+
+static int
+ecam_scan_parallel(struct pci_access *a UNUSED, int *domains UNUSED, int n UNUSED)
+{
+  return 0;
+}
+
+#endif
+
 static void
 ecam_scan(struct pci_access *a)
 {
   const char *addrs = pci_get_param(a, "ecam.addrs");
   struct ecam_access *eacc = a->backend_data;
   u32 *segments;
-  int i, j, count;
+  int *domains;
+  int i, j, count, n;
   int domain;
 
   segments = pci_malloc(a, 0xFFFF/8);
@@ -1119,18 +1394,107 @@ ecam_scan(struct pci_access *a)
         }
     }
 
+  n = 0;
+  domains = pci_malloc(a, 0xFFFF * sizeof(int));
   for (i = 0; i < 0xFFFF/32; i++)
     {
       if (!segments[i])
         continue;
       for (j = 0; j < 32; j++)
         if (segments[i] & (1 << j))
-          pci_generic_scan_domain(a, 32*i + j);
+          domains[n++] = 32*i + j;
     }
 
+  if (!ecam_scan_parallel(a, domains, n))
+    for (i = 0; i < n; i++)
+      pci_generic_scan_domain(a, domains[i]);
+
+  pci_mfree(domains);
   pci_mfree(segments);
 }
 
+/*
+ * Block transfers map the window of the function once and then access it
+ * directly, using the same access sizes as pci_generic_block_op() would.
+ */
+static int
+ecam_block_op(struct pci_dev *d, int pos, byte *buf, int len, int w)
+{
+  volatile void *reg;
+  volatile byte *p;
+  u16 v16;
+  u32 v32;
+
+  if (pos < 0 || len < 0 || pos + len > 4096)
+    return 0;
+  if (!len)
+    return 1;
+
+  /* Mapping the last dword first checks that the whole range is inside the mapping */
+  if (!mmap_reg(d->access, w, d->domain, d->bus, d->dev, d->func, (pos + len - 1) & ~3, &reg) ||
+      !mmap_reg(d->access, w, d->domain, d->bus, d->dev, d->func, pos, &reg))
+    return 0;
+  p = reg;
+
+  if ((pos & 1) && len >= 1)
+    {
+      if (w)
+        physmem_writeb(buf[0], p);
+      else
+        buf[0] = physmem_readb(p);
+      pos++; p++; buf++; len--;
+    }
+  if ((pos & 3) && len >= 2)
+    {
+      if (w)
+        {
+          memcpy(&v16, buf, 2);
+          physmem_writew(v16, p);
+        }
+      else
+        {
+          v16 = physmem_readw(p);
+          memcpy(buf, &v16, 2);
+        }
+      pos += 2; p += 2; buf += 2; len -= 2;
+    }
+  if (w)
+    for (; len >= 4; p += 4, buf += 4, len -= 4)
+      {
+        memcpy(&v32, buf, 4);
+        physmem_writel(v32, p);
+      }
+  else
+    for (; len >= 4; p += 4, buf += 4, len -= 4)
+      {
+        v32 = physmem_readl(p);
+        memcpy(buf, &v32, 4);
+      }
+  if (len >= 2)
+    {
+      if (w)
+        {
+          memcpy(&v16, buf, 2);
+          physmem_writew(v16, p);
+        }
+      else
+        {
+          v16 = physmem_readw(p);
+          memcpy(buf, &v16, 2);
+        }
+      p += 2; buf += 2; len -= 2;
+    }
+  if (len)
+    {
+      if (w)
+        physmem_writeb(buf[0], p);
+      else
+        buf[0] = physmem_readb(p);
+    }
+
+  return 1;
+}
+
 static int
 ecam_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
@@ -1140,7 +1504,7 @@ ecam_read(struct pci_dev *d, int pos, byte *buf, int len)
     return 0;
 
   if (len != 1 && len != 2 && len != 4)
-    return pci_generic_block_read(d, pos, buf, len);
+    return ecam_block_op(d, pos, buf, len, 0);
 
   if (!mmap_reg(d->access, 0, d->domain, d->bus, d->dev, d->func, pos, &reg))
     return 0;
@@ -1170,7 +1534,7 @@ ecam_write(struct pci_dev *d, int pos, byte *buf, int len)
     return 0;
 
   if (len != 1 && len != 2 && len != 4)
-    return pci_generic_block_read(d, pos, buf, len);
+    return ecam_block_op(d, pos, buf, len, 1);
 
   if (!mmap_reg(d->access, 1, d->domain, d->bus, d->dev, d->func, pos, &reg))
     return 0;
@@ -1202,4 +1566,5 @@ struct pci_methods pm_ecam = {
   .fill_info = pci_generic_fill_info,
   .read = ecam_read,
   .write = ecam_write,
+  .map_bus = ecam_map_bus,
 };
@@ -11,12 +11,48 @@
 #include <string.h>
 
 #include "internal.h"
+#include "physmem-access.h"
 
-void
-pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
+/*
+ *  Back-ends with memory-mapped config space (ECAM) can give us a pointer
+ *  to the config space of a whole bus, so that the probing of devices does
+ *  not have to go through the read method for every register. The back-end
+ *  may unmap the bus when we access another one, so we ask for the pointer
+ *  again after returning from a recursive scan.
+ */
+static inline volatile byte *
+scan_map_bus(struct pci_access *a, int domain, int bus)
+{
+  return a->methods->map_bus ? a->methods->map_bus(a, domain, bus) : NULL;
+}
+
+static inline u32
+scan_read_long(struct pci_dev *t, volatile byte *bus_map, int pos)
+{
+  if (bus_map)
+    return le32_to_cpu(physmem_readl(bus_map + (PCI_DEVFN(t->dev, t->func) << 12) + pos));
+  return pci_read_long(t, pos);
+}
+
+static inline byte
+scan_read_byte(struct pci_dev *t, volatile byte *bus_map, int pos)
+{
+  if (bus_map)
+    return physmem_readb(bus_map + (PCI_DEVFN(t->dev, t->func) << 12) + pos);
+  return pci_read_byte(t, pos);
+}
+
+/*
+ *  Devices found are linked to a->devices, or if list is not NULL, prepended
+ *  to a private list, which the caller links to a->devices later. This allows
+ *  scanning of multiple domains in parallel.
+ */
+static void
+pci_generic_scan_bus_to(struct pci_access *a, byte *busmap, int domain, int bus, struct pci_dev **list)
 {
   int dev, multi, ht;
   struct pci_dev *t;
+  volatile byte *bus_map;
 
   a->debug("Scanning bus %02x for devices...\n", bus);
   if (busmap[bus])
@@ -28,13 +64,14 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
   t = pci_alloc_dev(a);
   t->domain = domain;
   t->bus = bus;
+  bus_map = scan_map_bus(a, domain, bus);
   for (dev=0; dev<32; dev++)
     {
       t->dev = dev;
       multi = 0;
       for (t->func=0; !t->func || multi && t->func<8; t->func++)
 	{
-	  u32 vd = pci_read_long(t, PCI_VENDOR_ID);
+	  u32 vd = scan_read_long(t, bus_map, PCI_VENDOR_ID);
 	  struct pci_dev *d;
 
 	  if (!vd)
@@ -46,7 +83,7 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
 	      /*  some devices may hide themselves by setting their vendor and device ID to
 	       *  ffff:ffff so we check other registers
 	       */
-	      u32 command = pci_read_long(t, PCI_COMMAND);
+	      u32 command = scan_read_long(t, bus_map, PCI_COMMAND);
 	      
 	      /* if command is also ffffffff then there's probably no device here */
 	      if (command == 0xffffffff)
@@ -55,7 +92,7 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
 	      /* if there is a command then assume there's a device here that is hiding itself */
 	      hiding = 1;
 	    }
-	  ht = pci_read_byte(t, PCI_HEADER_TYPE);
+	  ht = scan_read_byte(t, bus_map, PCI_HEADER_TYPE);
 	  if (!t->func)
 	    multi = ht & 0x80;
 	  ht &= 0x7f;
@@ -69,7 +106,13 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
 	  d->device_id = vd >> 16U;
 	  d->known_fields = PCI_FILL_IDENT;
 	  d->hdrtype = ht;
-	  pci_link_dev(a, d);
+	  if (list)
+	    {
+	      d->next = *list;
+	      *list = d;
+	    }
+	  else
+	    pci_link_dev(a, d);
 	  switch (ht)
 	    {
 	    case PCI_HEADER_TYPE_NORMAL:
@@ -77,7 +120,10 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
 	    case PCI_HEADER_TYPE_BRIDGE:
 	    case PCI_HEADER_TYPE_CARDBUS:
 	      if (!hiding)
-	        pci_generic_scan_bus(a, busmap, domain, pci_read_byte(t, PCI_SECONDARY_BUS));
+		{
+		  pci_generic_scan_bus_to(a, busmap, domain, scan_read_byte(t, bus_map, PCI_SECONDARY_BUS), list);
+		  bus_map = scan_map_bus(a, domain, bus);
+		}
 	      break;
 	    default:
 	      if (!hiding)
@@ -89,12 +135,24 @@ pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
 }
 
 void
-pci_generic_scan_domain(struct pci_access *a, int domain)
+pci_generic_scan_bus(struct pci_access *a, byte *busmap, int domain, int bus)
+{
+  pci_generic_scan_bus_to(a, busmap, domain, bus, NULL);
+}
+
+void
+pci_generic_scan_domain_to(struct pci_access *a, int domain, struct pci_dev **list)
 {
   byte busmap[256];
 
   memset(busmap, 0, sizeof(busmap));
-  pci_generic_scan_bus(a, busmap, domain, 0);
+  pci_generic_scan_bus_to(a, busmap, domain, 0, list);
+}
+
+void
+pci_generic_scan_domain(struct pci_access *a, int domain)
+{
+  pci_generic_scan_domain_to(a, domain, NULL);
 }
 
 void
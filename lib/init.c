@@ -248,6 +248,16 @@ pci_malloc(struct pci_access *a, int size)
   return x;
 }
 
+void *
+pci_realloc(struct pci_access *a, void *old, int size)
+{
+  void *x = realloc(old, size);
+
+  if (!x)
+    (a && a->error ? a->error : pci_generic_error)("Out of memory (allocation of %d bytes failed)", size);
+  return x;
+}
+
 void
 pci_mfree(void *x)
 {
@@ -443,6 +453,7 @@ static void
 pci_init_dns(struct pci_access *a)
 {
   pci_define_param(a, "net.domain", PCI_ID_DOMAIN, "DNS domain used for resolving of ID's");
+  pci_define_param(a, "net.server", "", "DNS server for batched queries (address[:port], default=from resolv.conf)");
   a->id_lookup_mode = PCI_LOOKUP_CACHE;
 
   char *cache_dir = getenv("XDG_CACHE_HOME");
@@ -472,6 +483,15 @@ pci_alloc(void)
 #ifdef PCI_USE_DNS
   pci_init_dns(a);
 #endif
+#ifdef PCI_HAVE_MMAP
+  pci_define_param(a, "names.compiled", "1", "Use a compiled copy of the ID list if it is up to date and this is non-zero");
+  pci_define_param(a, "names.compiled_update", "0", "Create or refresh the compiled copy of the ID list after parsing the list if non-zero");
+  pci_define_param(a, "names.shared_cache", "", "Directory for compiled copies of ID lists stored in read-only locations");
+#endif
+  pci_define_param(a, "names.lazy", "0", "Parse only the parts of the ID list which are needed if non-zero");
+#ifdef PCI_HAVE_PTHREADS
+  pci_define_param(a, "names.threads", "1", "Number of threads used for parsing of the ID list (0=one per CPU)");
+#endif
 #ifdef PCI_HAVE_HWDB
   pci_define_param(a, "hwdb.disable", "0", "Do not look up names in UDEV's HWDB if non-zero");
 #endif
@@ -68,6 +68,12 @@ struct pci_methods {
   int (*read)(struct pci_dev *, int pos, byte *buf, int len);
   int (*write)(struct pci_dev *, int pos, byte *buf, int len);
   int (*read_vpd)(struct pci_dev *, int pos, byte *buf, int len);
+  int (*read_blocks)(struct pci_access *, struct pci_read_request *req, int n);
+  void (*prefetch_info)(struct pci_access *, struct pci_dev **devs, int n, unsigned int flags);
+  int (*hotplug_open)(struct pci_access *);
+  int (*rescan)(struct pci_access *);
+  int (*hotplug_event)(struct pci_access *, const char *msg, int len);
+  volatile void *(*map_bus)(struct pci_access *, int domain, int bus);
   void (*init_dev)(struct pci_dev *);
   void (*cleanup_dev)(struct pci_dev *);
 };
@@ -75,6 +81,7 @@ struct pci_methods {
 /* generic.c */
 void pci_generic_scan_bus(struct pci_access *, byte *busmap, int domain, int bus);
 void pci_generic_scan_domain(struct pci_access *, int domain);
+void pci_generic_scan_domain_to(struct pci_access *, int domain, struct pci_dev **list);
 void pci_generic_scan(struct pci_access *);
 void pci_generic_fill_info(struct pci_dev *, unsigned int flags);
 int pci_generic_block_read(struct pci_dev *, int pos, byte *buf, int len);
@@ -85,6 +92,7 @@ int pci_emulated_read(struct pci_dev *d, int pos, byte *buf, int len);
 
 /* init.c */
 void *pci_malloc(struct pci_access *, int);
+void *pci_realloc(struct pci_access *, void *, int);
 void pci_mfree(void *);
 char *pci_strdup(struct pci_access *a, const char *s);
 struct pci_access *pci_clone_access(struct pci_access *a);
@@ -96,6 +104,8 @@ void pci_init_v35(struct pci_access *a) VERSIONED_ABI;
 /* access.c */
 struct pci_dev *pci_alloc_dev(struct pci_access *);
 int pci_link_dev(struct pci_access *, struct pci_dev *);
+void pci_unlink_dev(struct pci_access *, struct pci_dev *);
+void pci_reset_properties(struct pci_dev *);
 
 int pci_fill_info_v30(struct pci_dev *, int flags) VERSIONED_ABI;
 int pci_fill_info_v31(struct pci_dev *, int flags) VERSIONED_ABI;
@@ -292,6 +292,70 @@ conf1_scan(struct pci_access *a)
     pci_generic_scan_domain(a, domain);
 }
 
+static inline void
+conf1_set_addr(struct pci_dev *d, int pos, volatile void *addr)
+{
+  physmem_writel(0x80000000 | ((pos & 0xf00) << 16) | ((d->bus & 0xff) << 16) | (PCI_DEVFN(d->dev, d->func) << 8) | (pos & 0xfc), addr);
+  physmem_readl(addr); /* write barrier for address */
+}
+
+/*
+ * Block reads look up and map the address and data registers once and then
+ * go through the config space using the same access sizes as
+ * pci_generic_block_op() would, but without calling back for every dword.
+ */
+static int
+conf1_ext_block_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  char *addrs_param_name = get_addrs_param_name(d->access);
+  char *addrs = pci_get_param(d->access, addrs_param_name);
+  volatile void *addr, *data;
+  volatile byte *p;
+  u64 addr_reg, data_reg;
+  u16 v16;
+  u32 v32;
+  int n;
+
+  if (pos < 0 || len < 0 || pos + len > 4096)
+    return 0;
+
+  if (!get_domain_addr(addrs, d->domain, &addr_reg, &data_reg))
+    return 0;
+
+  if (!mmap_regs(d->access, addr_reg, data_reg, 0, &addr, &data))
+    return 0;
+
+  while (len > 0)
+    {
+      if ((pos & 1) || len == 1)
+        n = 1;
+      else if ((pos & 2) || len < 4)
+        n = 2;
+      else
+        n = 4;
+
+      conf1_set_addr(d, pos, addr);
+      p = (volatile byte *) data + (pos & 3);
+      switch (n)
+        {
+        case 1:
+          buf[0] = physmem_readb(p);
+          break;
+        case 2:
+          v16 = physmem_readw(p);
+          memcpy(buf, &v16, 2);
+          break;
+        case 4:
+          v32 = physmem_readl(p);
+          memcpy(buf, &v32, 4);
+          break;
+        }
+      pos += n; buf += n; len -= n;
+    }
+
+  return 1;
+}
+
 static int
 conf1_ext_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
@@ -304,7 +368,7 @@ conf1_ext_read(struct pci_dev *d, int pos, byte *buf, int len)
     return 0;
 
   if (len != 1 && len != 2 && len != 4)
-    return pci_generic_block_read(d, pos, buf, len);
+    return conf1_ext_block_read(d, pos, buf, len);
 
   if (!get_domain_addr(addrs, d->domain, &addr_reg, &data_reg))
     return 0;
@@ -312,8 +376,7 @@ conf1_ext_read(struct pci_dev *d, int pos, byte *buf, int len)
   if (!mmap_regs(d->access, addr_reg, data_reg, pos&3, &addr, &data))
     return 0;
 
-  physmem_writel(0x80000000 | ((pos & 0xf00) << 16) | ((d->bus & 0xff) << 16) | (PCI_DEVFN(d->dev, d->func) << 8) | (pos & 0xfc), addr);
-  physmem_readl(addr); /* write barrier for address */
+  conf1_set_addr(d, pos, addr);
 
   switch (len)
     {
@@ -337,6 +400,10 @@ conf1_read(struct pci_dev *d, int pos, byte *buf, int len)
   if (pos >= 256)
     return 0;
 
+  /* Block reads beyond the standard config space would fail anyway */
+  if (len != 1 && len != 2 && len != 4 && pos + len > 256)
+    return 0;
+
   return conf1_ext_read(d, pos, buf, len);
 }
 
@@ -360,8 +427,7 @@ conf1_ext_write(struct pci_dev *d, int pos, byte *buf, int len)
   if (!mmap_regs(d->access, addr_reg, data_reg, pos&3, &addr, &data))
     return 0;
 
-  physmem_writel(0x80000000 | ((pos & 0xf00) << 16) | ((d->bus & 0xff) << 16) | (PCI_DEVFN(d->dev, d->func) << 8) | (pos & 0xfc), addr);
-  physmem_readl(addr); /* write barrier for address */
+  conf1_set_addr(d, pos, addr);
 
   switch (len)
     {
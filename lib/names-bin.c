@@ -0,0 +1,473 @@
+/*
+ *	The PCI Library -- Compiled ID Database
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+#include "names.h"
+
+#ifdef PCI_HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ *  The compiled database is a snapshot of all entries of the ID list,
+ *  stored as an open-addressing hash table followed by a pool of names.
+ *  It is meant to be mapped to memory and queried in place, so it is
+ *  kept in the native byte order and tagged with the size, inode number
+ *  and mtime (including nanoseconds) of the text file it was created from.
+ *  Whenever anything does not match, we fall back to parsing the text file.
+ *
+ *  The library writes the compiled copy only if asked to by the
+ *  names.compiled_update parameter (the compile-pciids utility does so),
+ *  or to the shared cache directory if one is configured.
+ *
+ *  The same table is also built in memory after parsing the text file,
+ *  so lookups take the same path regardless of where the table came from.
+ */
+
+static const char id_bin_magic[8] = "PCI-IDB\n";
+#define ID_BIN_VERSION 2
+#define ID_BIN_BYTE_ORDER 0x01020304
+
+struct id_bin_header {
+  char magic[8];
+  u32 version;
+  u32 byte_order;
+  u64 src_size;				/* Size of the source text file */
+  u64 src_mtime;			/* Its modification time */
+  u64 src_ino;				/* Its inode number */
+  u32 src_mtime_nsec;			/* Nanosecond part of the modification time */
+  u32 hash_size;			/* Number of hash table slots (a power of 2) */
+  u32 num_entries;
+  u32 names_size;			/* Size of the name pool, which follows the table */
+};
+
+struct id_bin_entry {
+  u32 id12, id34;
+  byte cat;				/* ID_UNKNOWN marks an empty slot */
+  byte src;
+  u16 rfu;
+  u32 name;				/* Offset in the name pool */
+};
+
+struct id_bin {
+  struct id_bin_entry *entries;
+  u32 mask;
+  u32 num_entries;
+  char *names;
+  u32 names_size;
+  void *map;				/* Mapped file or NULL if built in memory */
+  size_t map_size;
+};
+
+static inline u32 id_bin_hash(int cat, u32 id12, u32 id34)
+{
+  u32 h = (id12 * 0x9e3779b1) ^ ((id34 + cat) * 0x85ebca77);
+  return h ^ (h >> 15);
+}
+
+char *
+pci_id_bin_lookup(struct pci_access *a, int cat, u32 id12, u32 id34)
+{
+  struct id_bin *b = a->id_bin;
+  struct id_bin_entry *e;
+  u32 i, n;
+
+  i = id_bin_hash(cat, id12, id34);
+  for (n = 0; n <= b->mask; n++)
+    {
+      e = &b->entries[(i + n) & b->mask];
+      if (e->cat == ID_UNKNOWN)
+	break;
+      if (e->id12 == id12 && e->id34 == id34 && e->cat == cat)
+	return (e->name < b->names_size) ? b->names + e->name : NULL;
+    }
+  return NULL;
+}
+
+/*
+ *  After the text list has been parsed, we convert the hash to the same
+ *  compact table as used by the compiled database, so that each lookup
+ *  touches only a cache line or two instead of walking a chain of entries
+ *  scattered over the whole heap. The hash must contain only local entries
+ *  at this point, because it is freed afterwards.
+ */
+void
+pci_id_bin_build(struct pci_access *a)
+{
+  struct id_bin *b;
+  struct id_bin_entry *e;
+  struct id_entry *n;
+  u32 hash_size, num_entries, names_size, i;
+
+  if (!a->id_hash)
+    return;
+
+  num_entries = 0;
+  names_size = 1;
+  for (i=0; i<HASH_SIZE; i++)
+    for (n=a->id_hash[i]; n; n=n->next)
+      {
+	num_entries++;
+	names_size += strlen(n->name) + 1;
+      }
+
+  /* Keep the load factor below 2/3 */
+  hash_size = 16;
+  while (hash_size < num_entries + num_entries/2 + 1)
+    hash_size *= 2;
+
+  b = pci_malloc(a, sizeof(*b));
+  b->entries = pci_malloc(a, hash_size * sizeof(struct id_bin_entry) + names_size);
+  memset(b->entries, 0, hash_size * sizeof(struct id_bin_entry));
+  b->mask = hash_size - 1;
+  b->num_entries = num_entries;
+  b->names = (char *) (b->entries + hash_size);
+  b->names[0] = 0;
+  b->names_size = 1;
+  b->map = NULL;
+  b->map_size = 0;
+
+  for (i=0; i<HASH_SIZE; i++)
+    for (n=a->id_hash[i]; n; n=n->next)
+      {
+	u32 j = id_bin_hash(n->cat, n->id12, n->id34);
+	int len = strlen(n->name) + 1;
+	while ((e = &b->entries[j & b->mask])->cat != ID_UNKNOWN)
+	  j++;
+	e->id12 = n->id12;
+	e->id34 = n->id34;
+	e->cat = n->cat;
+	e->src = n->src;
+	e->name = b->names_size;
+	memcpy(b->names + b->names_size, n->name, len);
+	b->names_size += len;
+      }
+
+  pci_id_hash_free(a);
+  a->id_bin = b;
+}
+
+static void
+id_bin_destroy(struct id_bin *b)
+{
+#ifdef PCI_HAVE_MMAP
+  if (b->map)
+    munmap(b->map, b->map_size);
+  else
+#endif
+    pci_mfree(b->entries);
+  pci_mfree(b);
+}
+
+void
+pci_id_bin_free(struct pci_access *a)
+{
+  if (a->id_bin)
+    {
+      id_bin_destroy(a->id_bin);
+      a->id_bin = NULL;
+    }
+}
+
+#ifdef PCI_HAVE_MMAP
+
+#if defined(PCI_OS_DARWIN) || defined(PCI_OS_NETBSD)
+#define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+static char *
+id_bin_name(struct pci_access *a, struct stat *st)
+{
+  char *src = a->id_file_name;
+  int len = strlen(src);
+  char *name;
+
+  /* pci_open() silently falls back to the uncompressed file, so do we */
+  if (stat(src, st) < 0)
+    {
+      if (len < 3 || strcmp(src + len - 3, ".gz"))
+	return NULL;
+      len -= 3;
+      name = pci_malloc(a, len + 5);
+      memcpy(name, src, len);
+      name[len] = 0;
+      if (stat(name, st) < 0)
+	{
+	  pci_mfree(name);
+	  return NULL;
+	}
+    }
+  else
+    {
+      if (len >= 3 && !strcmp(src + len - 3, ".gz"))
+	len -= 3;
+      name = pci_malloc(a, len + 5);
+      memcpy(name, src, len);
+    }
+  strcpy(name + len, ".bin");
+  return name;
+}
+
+/*
+ *  If the directory with the ID list is not writable, the compiled database
+ *  can be kept in a shared cache directory instead (typically somewhere
+ *  in /run), so that it is built only once per machine. The name is derived
+ *  from the path of the primary copy, staleness is checked as usual.
+ */
+static char *
+id_bin_shared_name(struct pci_access *a, char *primary)
+{
+  char *dir = pci_get_param(a, "names.shared_cache");
+  u32 h = 2166136261U;
+  char *p, *name;
+
+  if (!dir || !dir[0])
+    return NULL;
+  for (p = primary; *p; p++)
+    h = (h ^ (byte) *p) * 16777619U;
+  name = pci_malloc(a, strlen(dir) + 32);
+  sprintf(name, "%s/pci-ids-%08x.bin", dir, h);
+  return name;
+}
+
+static int
+id_bin_param(struct pci_access *a, char *param)
+{
+  char *mode = pci_get_param(a, param);
+  return mode && atoi(mode) > 0;
+}
+
+static int
+id_bin_map(struct pci_access *a, char *name, struct stat *st)
+{
+  struct stat bst;
+  struct id_bin_header *h;
+  struct id_bin *b;
+  void *map;
+  size_t table_size;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      a->debug("Compiled ID database %s not available\n", name);
+      return 0;
+    }
+  map = MAP_FAILED;
+  if (fstat(fd, &bst) >= 0 && bst.st_size >= (off_t) sizeof(*h))
+    map = mmap(NULL, bst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    {
+      a->debug("Cannot map compiled ID database %s\n", name);
+      return 0;
+    }
+
+  h = map;
+  table_size = (size_t) h->hash_size * sizeof(struct id_bin_entry);
+  if (memcmp(h->magic, id_bin_magic, sizeof(id_bin_magic)) ||
+      h->version != ID_BIN_VERSION ||
+      h->byte_order != ID_BIN_BYTE_ORDER ||
+      !h->hash_size || (h->hash_size & (h->hash_size - 1)) ||
+      !h->names_size ||
+      sizeof(*h) + table_size + h->names_size != (size_t) bst.st_size ||
+      ((char *) map)[bst.st_size - 1])
+    {
+      a->debug("Compiled ID database %s is malformed, ignoring\n", name);
+      munmap(map, bst.st_size);
+      return 0;
+    }
+  if (h->src_size != (u64) st->st_size ||
+      h->src_mtime != (u64) st->st_mtime ||
+      h->src_mtime_nsec != (u32) ST_MTIME_NSEC(st) ||
+      h->src_ino != (u64) st->st_ino)
+    {
+      a->debug("Compiled ID database %s is out of date\n", name);
+      munmap(map, bst.st_size);
+      return 0;
+    }
+
+  a->debug("Using compiled ID database %s\n", name);
+  b = pci_malloc(a, sizeof(*b));
+  b->entries = (struct id_bin_entry *) (h + 1);
+  b->mask = h->hash_size - 1;
+  b->num_entries = h->num_entries;
+  b->names = (char *) b->entries + table_size;
+  b->names_size = h->names_size;
+  b->map = map;
+  b->map_size = bst.st_size;
+  a->id_bin = b;
+  return 1;
+}
+
+int
+pci_id_bin_load(struct pci_access *a)
+{
+  struct stat st;
+  char *name, *shared;
+  int ok;
+
+  if (!id_bin_param(a, "names.compiled") || !a->id_file_name)
+    return 0;
+  name = id_bin_name(a, &st);
+  if (!name)
+    return 0;
+  ok = id_bin_map(a, name, &st);
+  if (!ok && (shared = id_bin_shared_name(a, name)))
+    {
+      ok = id_bin_map(a, shared, &st);
+      pci_mfree(shared);
+    }
+  pci_mfree(name);
+  return ok;
+}
+
+/*
+ *  The compiled copy is written to a temporary file created securely
+ *  in the same directory and then atomically renamed to its final name,
+ *  so that readers never see a partially written file and we never
+ *  follow a symlink planted in a world-writable directory. Failures are
+ *  reported as warnings only when the user explicitly asked for the copy
+ *  and there is no other place to try; missing permissions to write to
+ *  the shared cache are common and perfectly fine.
+ */
+static void
+id_bin_write_failed(struct pci_access *a, char *name, int quiet)
+{
+  if (quiet)
+    a->debug("Cannot write compiled ID database %s: %s\n", name, strerror(errno));
+  else
+    a->warning("Cannot write compiled ID database %s: %s", name, strerror(errno));
+}
+
+static int
+id_bin_write(struct pci_access *a, char *name, struct stat *st, int quiet)
+{
+  struct id_bin *b = a->id_bin;
+  struct id_bin_header h;
+  char *tmpname;
+  FILE *f;
+  int fd, err;
+
+  tmpname = pci_malloc(a, strlen(name) + 8);
+  sprintf(tmpname, "%s.XXXXXX", name);
+  fd = mkstemp(tmpname);
+  if (fd < 0)
+    {
+      id_bin_write_failed(a, name, quiet);
+      pci_mfree(tmpname);
+      return 0;
+    }
+  /* mkstemp() creates the file private to us, but the database is public */
+  if (fchmod(fd, 0644) < 0 || !(f = fdopen(fd, "wb")))
+    {
+      id_bin_write_failed(a, name, quiet);
+      close(fd);
+      unlink(tmpname);
+      pci_mfree(tmpname);
+      return 0;
+    }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, id_bin_magic, sizeof(id_bin_magic));
+  h.version = ID_BIN_VERSION;
+  h.byte_order = ID_BIN_BYTE_ORDER;
+  h.src_size = st->st_size;
+  h.src_mtime = st->st_mtime;
+  h.src_mtime_nsec = ST_MTIME_NSEC(st);
+  h.src_ino = st->st_ino;
+  h.hash_size = b->mask + 1;
+  h.num_entries = b->num_entries;
+  h.names_size = b->names_size;
+
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(b->entries, sizeof(struct id_bin_entry), b->mask + 1, f);
+  fwrite(b->names, 1, b->names_size, f);
+  fflush(f);
+
+  err = ferror(f);
+  if (fclose(f) < 0)
+    err = 1;
+  if (err || rename(tmpname, name) < 0)
+    {
+      id_bin_write_failed(a, name, quiet);
+      unlink(tmpname);
+      pci_mfree(tmpname);
+      return 0;
+    }
+
+  a->debug("Written compiled ID database %s (%d entries)\n", name, b->num_entries);
+  pci_mfree(tmpname);
+  return 1;
+}
+
+void
+pci_id_bin_save(struct pci_access *a)
+{
+  struct id_bin *b = a->id_bin;
+  struct stat st;
+  char *name, *shared, *written;
+  int update;
+
+  if (!b || b->map)
+    return;
+  update = id_bin_param(a, "names.compiled_update");
+  name = id_bin_name(a, &st);
+  if (!name)
+    return;
+  shared = id_bin_shared_name(a, name);
+
+  written = NULL;
+  if (update && id_bin_write(a, name, &st, shared != NULL))
+    written = name;
+  else if (shared)
+    {
+      mkdir(pci_get_param(a, "names.shared_cache"), 0755);
+      if (id_bin_write(a, shared, &st, 1))
+	written = shared;
+    }
+
+  /* Switch to the written copy, so that our memory is shared with other processes */
+  if (written)
+    {
+      a->id_bin = NULL;
+      if (id_bin_map(a, written, &st))
+	id_bin_destroy(b);
+      else
+	a->id_bin = b;
+    }
+
+  pci_mfree(shared);
+  pci_mfree(name);
+}
+
+#else
+
+int
+pci_id_bin_load(struct pci_access *a UNUSED)
+{
+  return 0;
+}
+
+void
+pci_id_bin_save(struct pci_access *a UNUSED)
+{
+}
+
+#endif
@@ -17,12 +17,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <unistd.h>
-
-static const char cache_version[] = "#PCI-CACHE-1.0";
+#ifdef PCI_HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 static char *get_cache_name(struct pci_access *a)
 {
@@ -97,13 +100,314 @@ static void create_parent_dirs(struct pci_access *a, char *name)
     }
 }
 
+/*
+ *  The cache is a binary file in the native byte order (it is private
+ *  to the user and the machine anyway). It consists of a header, an index
+ *  (an open-addressing hash table of record offsets) and a sequence of
+ *  records. Records behind the indexed part have been appended by later
+ *  flushes; they are indexed in memory when the cache is loaded. When
+ *  this unindexed tail grows too long, the whole file is rewritten with
+ *  a new index and atomically renamed over the original.
+ *
+ *  Older versions used a text format, which is still recognized and
+ *  converted to the binary one when the cache is written next time.
+ */
+
+static const char cache_magic[8] = "PCI-IDC\n";
+static const char cache_text_version[] = "#PCI-CACHE-1.0";
+#define CACHE_VERSION 2
+#define CACHE_BYTE_ORDER 0x01020304
+#define CACHE_MAX_SIZE (1U << 30)
+
+struct cache_header {
+  char magic[8];
+  u32 version;
+  u32 byte_order;
+  u32 index_size;			/* Number of index slots (a power of 2, or 0) */
+  u32 num_indexed;			/* Number of records in the index */
+  u32 indexed_end;			/* Records behind this offset are not indexed */
+  u32 rfu;
+};
+
+struct cache_record {
+  u16 id[4];
+  byte cat;
+  byte rfu;
+  u16 len;				/* Length of the name, 0 if the ID is not known to the DNS */
+  char name[1];				/* Always null-terminated */
+};
+
+#define CACHE_REC_SIZE(len) ((offsetof(struct cache_record, name) + (len) + 1 + 3) & ~3U)
+
+struct id_cache {
+  byte *data;				/* Contents of the cache file */
+  u32 size;
+  int mapped;
+  u32 *index;				/* Index stored in the file */
+  u32 index_size;
+  u32 num_indexed;
+  u32 tail_start, tail_end;		/* Unindexed records */
+  u32 *tail;				/* ... and their in-memory index */
+  u32 tail_size;
+  u32 num_tail;
+  byte *pending;			/* Records to be appended */
+  u32 pending_len, pending_max;
+  u32 num_pending;
+  int rewrite;				/* The file has to be rewritten from scratch */
+};
+
+static inline u32 cache_hash(int cat, int id1, int id2, int id3, int id4)
+{
+  u32 h = (id_pair(id1, id2) * 0x9e3779b1) ^ ((id_pair(id3, id4) + cat) * 0x85ebca77);
+  return h ^ (h >> 15);
+}
+
+static struct id_cache *
+cache_get(struct pci_access *a)
+{
+  if (!a->id_cache)
+    {
+      a->id_cache = pci_malloc(a, sizeof(struct id_cache));
+      memset(a->id_cache, 0, sizeof(struct id_cache));
+    }
+  return a->id_cache;
+}
+
+/* Return a record at the given offset if it is well-formed */
+static struct cache_record *
+cache_record(byte *base, u32 size, u32 off)
+{
+  struct cache_record *r;
+
+  if ((off & 3) || off >= size || size - off < CACHE_REC_SIZE(0))
+    return NULL;
+  r = (struct cache_record *) (base + off);
+  if (size - off < CACHE_REC_SIZE(r->len) || r->name[r->len])
+    return NULL;
+  return r;
+}
+
+static inline int
+cache_match(struct cache_record *r, int cat, int id1, int id2, int id3, int id4)
+{
+  return (r->cat == cat && r->id[0] == id1 && r->id[1] == id2 && r->id[2] == id3 && r->id[3] == id4);
+}
+
+static struct cache_record *
+cache_find(struct id_cache *c, u32 *table, u32 size, int cat, int id1, int id2, int id3, int id4)
+{
+  struct cache_record *r;
+  u32 h, n, off;
+
+  h = cache_hash(cat, id1, id2, id3, id4);
+  for (n=0; n<size; n++)
+    {
+      off = table[(h + n) & (size - 1)];
+      if (!off || !(r = cache_record(c->data, c->size, off)))
+	return NULL;
+      if (cache_match(r, cat, id1, id2, id3, id4))
+	return r;
+    }
+  return NULL;
+}
+
+static u32
+cache_table_size(u32 n)
+{
+  u32 size = 16;
+  while (size < 2*n)
+    size *= 2;
+  return size;
+}
+
+/* Append a record to a growing buffer */
+static void
+cache_put(struct pci_access *a, byte **buf, u32 *len, u32 *max, int cat, int id1, int id2, int id3, int id4, char *name)
+{
+  struct cache_record *r;
+  u32 nlen = name ? strlen(name) : 0;
+  u32 rlen;
+
+  if (nlen > 0xffff)
+    nlen = 0xffff;
+  rlen = CACHE_REC_SIZE(nlen);
+  if (*len + rlen > *max)
+    {
+      while (*len + rlen > *max)
+	*max = (*max ? 2 * *max : 1024);
+      *buf = pci_realloc(a, *buf, *max);
+    }
+  r = (struct cache_record *) (*buf + *len);
+  memset(r, 0, rlen);
+  r->id[0] = id1;
+  r->id[1] = id2;
+  r->id[2] = id3;
+  r->id[3] = id4;
+  r->cat = cat;
+  r->len = nlen;
+  memcpy(r->name, name ? name : "", nlen);
+  *len += rlen;
+}
+
+static void
+cache_free_data(struct id_cache *c)
+{
+#ifdef PCI_HAVE_MMAP
+  if (c->mapped)
+    munmap(c->data, c->size);
+  else
+#endif
+    pci_mfree(c->data);
+  c->data = NULL;
+  c->mapped = 0;
+}
+
+/* Convert the old text format to records which are not indexed yet */
+static int
+cache_convert_text(struct pci_access *a, struct id_cache *c, char *name)
+{
+  char line[MAX_LINE];
+  byte *buf = NULL;
+  u32 len = sizeof(struct cache_header), max = 0, pos, next;
+  int lino;
+
+  max = 1024;
+  buf = pci_malloc(a, max);
+  memset(buf, 0, len);
+
+  pos = strlen(cache_text_version) + 1;
+  lino = 1;
+  while (pos < c->size)
+    {
+      int cat, id1, id2, id3, id4, cnt;
+      char *p;
+
+      lino++;
+      for (next=pos; next < c->size && c->data[next] != '\n'; next++)
+	;
+      if (next == c->size || next - pos >= sizeof(line))
+	goto bad;
+      memcpy(line, c->data + pos, next - pos);
+      line[next - pos] = 0;
+      pos = next + 1;
+      if (sscanf(line, "%d%x%x%x%x%n", &cat, &id1, &id2, &id3, &id4, &cnt) < 5)
+	goto bad;
+      p = line + cnt;
+      while (*p == ' ')
+	p++;
+      cache_put(a, &buf, &len, &max, cat, id1, id2, id3, id4, p);
+    }
+
+  cache_free_data(c);
+  c->data = buf;
+  c->size = len;
+  c->mapped = 0;
+  return 1;
+
+bad:
+  a->warning("Malformed cache file %s (line %d), ignoring", name, lino);
+  pci_mfree(buf);
+  return 0;
+}
+
+static int
+cache_read(struct pci_access *a, struct id_cache *c, char *name)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      a->debug("Cache file does not exist\n");
+      return 0;
+    }
+  if (fstat(fd, &st) < 0 || st.st_size >= CACHE_MAX_SIZE)
+    {
+      a->warning("Cannot read %s", name);
+      close(fd);
+      return 0;
+    }
+  c->size = st.st_size;
+  if (!c->size)
+    {
+      close(fd);
+      return 0;
+    }
+
+#ifdef PCI_HAVE_MMAP
+  c->data = mmap(NULL, c->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (c->data != MAP_FAILED)
+    c->mapped = 1;
+  else
+#endif
+    {
+      c->data = pci_malloc(a, c->size);
+      if (read(fd, c->data, c->size) != (ssize_t) c->size)
+	{
+	  a->warning("Error while reading %s", name);
+	  pci_mfree(c->data);
+	  c->data = NULL;
+	}
+    }
+  close(fd);
+  return !!c->data;
+}
+
+static void
+cache_unload(struct id_cache *c)
+{
+  cache_free_data(c);
+  pci_mfree(c->tail);
+  c->data = NULL;
+  c->tail = NULL;
+  c->index = NULL;
+  c->index_size = c->num_indexed = c->num_tail = 0;
+  c->tail_start = c->tail_end = 0;
+}
+
+/* Build an in-memory index of records appended after the last rewrite */
+static void
+cache_index_tail(struct pci_access *a, struct id_cache *c)
+{
+  struct cache_record *r;
+  u32 off, h, n, *slot;
+
+  for (off = c->tail_start; r = cache_record(c->data, c->size, off); off += CACHE_REC_SIZE(r->len))
+    c->num_tail++;
+  c->tail_end = off;
+  if (c->tail_end != c->size)
+    {
+      /* Torn or garbled tail, appending behind it would make the new records unreachable */
+      a->debug("Cache has %u bytes of garbage at the end, will rewrite it\n", c->size - c->tail_end);
+      c->rewrite = 1;
+    }
+  if (!c->num_tail)
+    return;
+
+  c->tail_size = cache_table_size(c->num_tail);
+  c->tail = pci_malloc(a, c->tail_size * sizeof(u32));
+  memset(c->tail, 0, c->tail_size * sizeof(u32));
+  for (off = c->tail_start; off < c->tail_end; off += CACHE_REC_SIZE(r->len))
+    {
+      r = cache_record(c->data, c->size, off);
+      h = cache_hash(r->cat, r->id[0], r->id[1], r->id[2], r->id[3]);
+      for (n=0;; n++)
+	{
+	  slot = &c->tail[(h + n) & (c->tail_size - 1)];
+	  if (!*slot || cache_match(cache_record(c->data, c->size, *slot), r->cat, r->id[0], r->id[1], r->id[2], r->id[3]))
+	    break;
+	}
+      *slot = off;			/* Later records take precedence */
+    }
+}
+
 int
 pci_id_cache_load(struct pci_access *a, int flags)
 {
+  struct id_cache *c;
+  struct cache_header *hdr;
   char *name;
-  char line[MAX_LINE];
-  FILE *f;
-  int lino;
 
   if (a->id_cache_status > 0)
     return 0;
@@ -113,132 +417,265 @@ pci_id_cache_load(struct pci_access *a, int flags)
   if (!name)
     return 0;
   a->debug("Using cache %s\n", name);
+  c = cache_get(a);
+  if (c->num_pending)
+    a->id_cache_status = 2;
 
   if (flags & PCI_LOOKUP_REFRESH_CACHE)
     {
       a->debug("Not loading cache, will refresh everything\n");
       a->id_cache_status = 2;
+      c->rewrite = 1;
       return 0;
     }
 
-  f = fopen(name, "rb");
-  if (!f)
+  if (!cache_read(a, c, name))
     {
-      a->debug("Cache file does not exist\n");
+      c->rewrite = 1;
       return 0;
     }
   /* FIXME: Compare timestamp with the pci.ids file? */
 
-  lino = 0;
-  while (fgets(line, sizeof(line), f))
+  hdr = (struct cache_header *) c->data;
+  if (c->size >= sizeof(struct cache_header) &&
+      !memcmp(hdr->magic, cache_magic, sizeof(cache_magic)) &&
+      hdr->version == CACHE_VERSION &&
+      hdr->byte_order == CACHE_BYTE_ORDER &&
+      !(hdr->index_size & (hdr->index_size - 1)) &&
+      hdr->index_size <= (c->size - sizeof(struct cache_header)) / sizeof(u32) &&
+      hdr->indexed_end >= sizeof(struct cache_header) + hdr->index_size * sizeof(u32) &&
+      hdr->indexed_end <= c->size)
     {
-      char *p = strchr(line, '\n');
-      lino++;
-      if (p)
-        {
-	  *p = 0;
-	  if (lino == 1)
-	    {
-	      if (strcmp(line, cache_version))
-	        {
-		  a->debug("Unrecognized cache version %s, ignoring\n", line);
-		  break;
-		}
-	      continue;
-	    }
-	  else
-	    {
-	      int cat, id1, id2, id3, id4, cnt;
-	      if (sscanf(line, "%d%x%x%x%x%n", &cat, &id1, &id2, &id3, &id4, &cnt) >= 5)
-	        {
-		  p = line + cnt;
-		  while (*p && *p == ' ')
-		    p++;
-		  pci_id_insert(a, cat, id1, id2, id3, id4, p, SRC_CACHE);
-		  continue;
-		}
-	    }
+      c->index = (u32 *) (c->data + sizeof(struct cache_header));
+      c->index_size = hdr->index_size;
+      c->num_indexed = hdr->num_indexed;
+      c->tail_start = hdr->indexed_end;
+    }
+  else if (c->size > strlen(cache_text_version) &&
+	   !memcmp(c->data, cache_text_version, strlen(cache_text_version)) &&
+	   c->data[strlen(cache_text_version)] == '\n')
+    {
+      a->debug("Converting cache from the text format\n");
+      if (!cache_convert_text(a, c, name))
+	{
+	  cache_unload(c);
+	  c->rewrite = 1;
+	  return 0;
 	}
-      a->warning("Malformed cache file %s (line %d), ignoring", name, lino);
-      break;
+      c->tail_start = sizeof(struct cache_header);
+      c->rewrite = 1;
+    }
+  else
+    {
+      a->debug("Unrecognized cache format, ignoring\n");
+      cache_unload(c);
+      c->rewrite = 1;
+      return 0;
     }
 
-  if (ferror(f))
-    a->warning("Error while reading %s", name);
-  fclose(f);
+  cache_index_tail(a, c);
+  a->debug("Cache: %u indexed records, %u appended\n", c->num_indexed, c->num_tail);
   return 1;
 }
 
+char *
+pci_id_cache_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, int *absent)
+{
+  struct id_cache *c = a->id_cache;
+  struct cache_record *r = NULL;
+
+  *absent = 0;
+  if (!c || !c->data)
+    return NULL;
+  if (c->tail)
+    r = cache_find(c, c->tail, c->tail_size, cat, id1, id2, id3, id4);
+  if (!r && c->index_size)
+    r = cache_find(c, c->index, c->index_size, cat, id1, id2, id3, id4);
+  if (!r)
+    return NULL;
+  if (!r->len)
+    {
+      *absent = 1;
+      return NULL;
+    }
+  return r->name;
+}
+
 void
-pci_id_cache_flush(struct pci_access *a)
+pci_id_cache_add(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *name)
 {
-  int orig_status = a->id_cache_status;
-  FILE *f;
-  unsigned int h;
-  struct id_entry *e, *e2;
-  char hostname[256], *tmpname, *name;
-  int this_pid;
+  struct id_cache *c = cache_get(a);
 
-  a->id_cache_status = 0;
-  if (orig_status < 2)
-    return;
-  name = get_cache_name(a);
-  if (!name)
-    return;
+  cache_put(a, &c->pending, &c->pending_len, &c->pending_max, cat, id1, id2, id3, id4, name);
+  c->num_pending++;
+  if (a->id_cache_status >= 1)
+    a->id_cache_status = 2;
+}
 
-  create_parent_dirs(a, name);
+static char *
+cache_tmp_name(struct pci_access *a, char *name)
+{
+  char hostname[256], *tmpname;
 
-  this_pid = getpid();
   if (gethostname(hostname, sizeof(hostname)) < 0)
     hostname[0] = 0;
   else
     hostname[sizeof(hostname)-1] = 0;
   tmpname = pci_malloc(a, strlen(name) + strlen(hostname) + 64);
-  sprintf(tmpname, "%s.tmp-%s-%d", name, hostname, this_pid);
+  sprintf(tmpname, "%s.tmp-%s-%d", name, hostname, (int) getpid());
+  return tmpname;
+}
+
+/* Merge all records to a new table, later records take precedence */
+static void
+cache_merge(struct cache_record **table, u32 size, u32 *count, byte *base, u32 base_size, u32 start, u32 end)
+{
+  struct cache_record *r, **slot;
+  u32 off, h, n;
+
+  for (off = start; off < end && (r = cache_record(base, base_size, off)); off += CACHE_REC_SIZE(r->len))
+    {
+      h = cache_hash(r->cat, r->id[0], r->id[1], r->id[2], r->id[3]);
+      for (n=0;; n++)
+	{
+	  slot = &table[(h + n) & (size - 1)];
+	  if (!*slot || cache_match(*slot, r->cat, r->id[0], r->id[1], r->id[2], r->id[3]))
+	    break;
+	}
+      if (!*slot)
+	(*count)++;
+      *slot = r;
+    }
+}
 
+static void
+cache_rewrite(struct pci_access *a, struct id_cache *c, char *name)
+{
+  struct cache_record **table, *r;
+  struct cache_header hdr;
+  u32 size, count, i, off, *index;
+  char *tmpname;
+  FILE *f;
+  int err;
+
+  size = cache_table_size(c->num_indexed + c->num_tail + c->num_pending);
+  table = pci_malloc(a, size * sizeof(struct cache_record *));
+  memset(table, 0, size * sizeof(struct cache_record *));
+  count = 0;
+  for (i=0; i < c->index_size; i++)
+    if (c->index[i])
+      cache_merge(table, size, &count, c->data, c->size, c->index[i], c->index[i] + 1);
+  cache_merge(table, size, &count, c->data, c->size, c->tail_start, c->tail_end);
+  cache_merge(table, size, &count, c->pending, c->pending_len, 0, c->pending_len);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+  hdr.version = CACHE_VERSION;
+  hdr.byte_order = CACHE_BYTE_ORDER;
+  hdr.index_size = size;
+  hdr.num_indexed = count;
+  index = pci_malloc(a, size * sizeof(u32));
+  off = sizeof(hdr) + size * sizeof(u32);
+  for (i=0; i<size; i++)
+    if (r = table[i])
+      {
+	index[i] = off;
+	off += CACHE_REC_SIZE(r->len);
+      }
+    else
+      index[i] = 0;
+  hdr.indexed_end = off;
+
+  tmpname = cache_tmp_name(a, name);
   f = fopen(tmpname, "wb");
   if (!f)
     {
       a->warning("Cannot write to %s: %s", name, strerror(errno));
-      pci_mfree(tmpname);
-      return;
+      goto done;
+    }
+  a->debug("Writing cache to %s (%u records)\n", name, count);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(index, sizeof(u32), size, f);
+  for (i=0; i<size; i++)
+    if (r = table[i])
+      fwrite(r, CACHE_REC_SIZE(r->len), 1, f);
+  fflush(f);
+  err = ferror(f);
+  if (fclose(f))
+    err = 1;
+  if (err)
+    {
+      a->warning("Error writing %s", name);
+      unlink(tmpname);
     }
-  a->debug("Writing cache to %s\n", name);
-  fprintf(f, "%s\n", cache_version);
+  else if (rename(tmpname, name) < 0)
+    {
+      a->warning("Cannot rename %s to %s: %s", tmpname, name, strerror(errno));
+      unlink(tmpname);
+    }
+
+done:
+  pci_mfree(tmpname);
+  pci_mfree(index);
+  pci_mfree(table);
+}
+
+/* Append pending records to the file if it is still in the expected format */
+static int
+cache_append(struct pci_access *a, struct id_cache *c, char *name)
+{
+  struct cache_header hdr;
+  struct stat st;
+  int fd, ok;
 
-  for (h=0; h<HASH_SIZE; h++)
-    for (e=a->id_hash[h]; e; e=e->next)
-      if (e->src == SRC_CACHE || e->src == SRC_NET)
+  fd = open(name, O_RDWR | O_APPEND);
+  if (fd < 0)
+    return 0;
+  ok = (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	!memcmp(hdr.magic, cache_magic, sizeof(cache_magic)) &&
+	hdr.version == CACHE_VERSION &&
+	hdr.byte_order == CACHE_BYTE_ORDER &&
+	fstat(fd, &st) >= 0);
+  if (ok)
+    {
+      a->debug("Appending %u records to cache %s\n", c->num_pending, name);
+      if (write(fd, c->pending, c->pending_len) != (ssize_t) c->pending_len)
 	{
-	  /* Negative entries are not written */
-	  if (!e->name[0])
-	    continue;
-
-	  /* Verify that every entry is written at most once */
-	  for (e2=a->id_hash[h]; e2 != e; e2=e2->next)
-	    if ((e2->src == SRC_CACHE || e2->src == SRC_NET) &&
-	        e2->cat == e->cat &&
-		e2->id12 == e->id12 && e2->id34 == e->id34)
-	    break;
-	  if (e2 == e)
-	    fprintf(f, "%d %x %x %x %x %s\n",
-	            e->cat,
-		    pair_first(e->id12), pair_second(e->id12),
-		    pair_first(e->id34), pair_second(e->id34),
-		    e->name);
+	  /* Do not leave a partial record behind, rewriting the file is the safer bet */
+	  a->debug("Error appending to %s: %s\n", name, strerror(errno));
+	  if (ftruncate(fd, st.st_size) < 0)
+	    a->warning("Cannot truncate %s: %s", name, strerror(errno));
+	  ok = 0;
 	}
+    }
+  close(fd);
+  return ok;
+}
 
-  fflush(f);
-  if (ferror(f))
-    a->warning("Error writing %s", name);
-  fclose(f);
+void
+pci_id_cache_flush(struct pci_access *a)
+{
+  int orig_status = a->id_cache_status;
+  struct id_cache *c = a->id_cache;
+  char *name;
 
-  if (rename(tmpname, name) < 0)
+  a->id_cache_status = 0;
+  if (!c)
+    return;
+  if (orig_status >= 2 && (name = get_cache_name(a)))
     {
-      a->warning("Cannot rename %s to %s: %s", tmpname, name, strerror(errno));
-      unlink(tmpname);
+      create_parent_dirs(a, name);
+      /* Keep the unindexed part short, so that loading takes constant time */
+      if (c->rewrite ||
+	  (c->num_tail + c->num_pending > 64 && c->num_tail + c->num_pending > c->num_indexed / 4) ||
+	  !cache_append(a, c, name))
+	cache_rewrite(a, c, name);
     }
-  pci_mfree(tmpname);
+
+  cache_unload(c);
+  pci_mfree(c->pending);
+  pci_mfree(c);
+  a->id_cache = NULL;
 }
 
 #else
@@ -249,6 +686,16 @@ int pci_id_cache_load(struct pci_access *a UNUSED, int flags UNUSED)
   return 0;
 }
 
+char *pci_id_cache_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED, int id2 UNUSED, int id3 UNUSED, int id4 UNUSED, int *absent)
+{
+  *absent = 0;
+  return NULL;
+}
+
+void pci_id_cache_add(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED, int id2 UNUSED, int id3 UNUSED, int id4 UNUSED, char *name UNUSED)
+{
+}
+
 void pci_id_cache_flush(struct pci_access *a)
 {
   a->id_cache_status = 0;
@@ -257,10 +704,3 @@ void pci_id_cache_flush(struct pci_access *a)
 }
 
 #endif
-
-void
-pci_id_cache_dirty(struct pci_access *a)
-{
-  if (a->id_cache_status >= 1)
-    a->id_cache_status = 2;
-}
@@ -29,22 +29,25 @@ union id_align {
 #endif
 #define BUCKET_ALIGN(n) ((n)+BUCKET_ALIGNMENT-(n)%BUCKET_ALIGNMENT)
 
-static void *id_alloc(struct pci_access *a, unsigned int size)
+static void id_hash_alloc(struct pci_access *a)
 {
-  struct id_bucket *buck = a->current_id_bucket;
-  unsigned int pos;
-
   if (!a->id_hash)
     {
       a->id_hash = pci_malloc(a, sizeof(struct id_entry *) * HASH_SIZE);
       memset(a->id_hash, 0, sizeof(struct id_entry *) * HASH_SIZE);
     }
+}
+
+static void *id_bucket_alloc(struct pci_access *a, struct id_bucket **list, unsigned int size)
+{
+  struct id_bucket *buck = *list;
+  unsigned int pos;
 
   if (!buck || buck->full + size > BUCKET_SIZE)
     {
       buck = pci_malloc(a, BUCKET_SIZE);
-      buck->next = a->current_id_bucket;
-      a->current_id_bucket = buck;
+      buck->next = *list;
+      *list = buck;
       buck->full = BUCKET_ALIGN(sizeof(struct id_bucket));
     }
   pos = buck->full;
@@ -52,6 +55,12 @@ static void *id_alloc(struct pci_access *a, unsigned int size)
   return (byte *)buck + pos;
 }
 
+static void *id_alloc(struct pci_access *a, unsigned int size)
+{
+  id_hash_alloc(a);
+  return id_bucket_alloc(a, &a->current_id_bucket, size);
+}
+
 static inline unsigned int id_hash(int cat, u32 id12, u32 id34)
 {
   unsigned int h;
@@ -69,7 +78,7 @@ pci_id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4,
   struct id_entry *n = a->id_hash ? a->id_hash[h] : NULL;
   int len = strlen(text);
 
-  while (n && (n->id12 != id12 || n->id34 != id34 || n->cat != cat))
+  while (n && (n->id12 != id12 || n->id34 != id34 || n->cat != cat || n->src == SRC_ABSENT))
     n = n->next;
   if (n)
     return 1;
@@ -78,18 +87,86 @@ pci_id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4,
   n->id34 = id34;
   n->cat = cat;
   n->src = src;
+  n->absent = 0;
   memcpy(n->name, text, len+1);
   n->next = a->id_hash[h];
   a->id_hash[h] = n;
   return 0;
 }
 
+/*
+ *  Arenas are used by the parallel parser: each thread collects its entries
+ *  in a private arena, which does not touch the pci_access at all (except
+ *  for error reporting if we run out of memory). The arenas are then merged
+ *  to the hash in the original order by pci_id_link() and pci_id_arena_adopt().
+ */
+
+void
+pci_id_arena_init(struct id_arena *ar)
+{
+  ar->buckets = NULL;
+  ar->first = NULL;
+  ar->last = &ar->first;
+}
+
+void
+pci_id_arena_add(struct pci_access *a, struct id_arena *ar, int lino, int cat, int id1, int id2, int id3, int id4, char *text)
+{
+  int len = strlen(text);
+  struct id_arena_item *it = id_bucket_alloc(a, &ar->buckets, sizeof(struct id_arena_item) + len);
+
+  it->next = NULL;
+  it->lino = lino;
+  it->e.id12 = id_pair(id1, id2);
+  it->e.id34 = id_pair(id3, id4);
+  it->e.cat = cat;
+  it->e.src = SRC_LOCAL;
+  it->e.absent = 0;
+  memcpy(it->e.name, text, len+1);
+  *ar->last = it;
+  ar->last = &it->next;
+}
+
+int
+pci_id_link(struct pci_access *a, struct id_entry *e)
+{
+  unsigned int h = id_hash(e->cat, e->id12, e->id34);
+  struct id_entry *n;
+
+  id_hash_alloc(a);
+  for (n = a->id_hash[h]; n; n = n->next)
+    if (n->id12 == e->id12 && n->id34 == e->id34 && n->cat == e->cat)
+      return 1;
+  e->next = a->id_hash[h];
+  a->id_hash[h] = e;
+  return 0;
+}
+
+void
+pci_id_arena_adopt(struct pci_access *a, struct id_arena *ar)
+{
+  struct id_bucket *buck;
+
+  while (buck = ar->buckets)
+    {
+      ar->buckets = buck->next;
+      buck->next = a->current_id_bucket;
+      a->current_id_bucket = buck;
+    }
+  pci_id_arena_init(ar);
+}
+
 char
 *pci_id_lookup(struct pci_access *a, int flags, int cat, int id1, int id2, int id3, int id4)
 {
   struct id_entry *n, *best;
   u32 id12 = id_pair(id1, id2);
   u32 id34 = id_pair(id3, id4);
+  char *name;
+
+  /* Entries of the local database take precedence over all other sources */
+  if (a->id_bin && !(flags & PCI_LOOKUP_SKIP_LOCAL) && (name = pci_id_bin_lookup(a, cat, id12, id34)))
+    return name;
 
   if (a->id_hash)
     {
@@ -97,7 +174,7 @@ char
       best = NULL;
       for (; n; n=n->next)
         {
-	  if (n->id12 != id12 || n->id34 != id34 || n->cat != cat)
+	  if (n->id12 != id12 || n->id34 != id34 || n->cat != cat || n->src == SRC_ABSENT)
 	    continue;
 	  if (n->src == SRC_LOCAL && (flags & PCI_LOOKUP_SKIP_LOCAL))
 	    continue;
@@ -116,6 +193,55 @@ char
   return NULL;
 }
 
+/*
+ *  Failed lookups in expensive sources (hwdb, DNS) are remembered
+ *  as SRC_ABSENT entries, one per ID, with a mask of the sources
+ *  which have been asked in vain.
+ */
+
+static struct id_entry *id_find_absent(struct pci_access *a, int cat, u32 id12, u32 id34)
+{
+  struct id_entry *n;
+
+  if (!a->id_hash)
+    return NULL;
+  for (n = a->id_hash[id_hash(cat, id12, id34)]; n; n = n->next)
+    if (n->src == SRC_ABSENT && n->id12 == id12 && n->id34 == id34 && n->cat == cat)
+      return n;
+  return NULL;
+}
+
+int
+pci_id_absent(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, enum id_entry_src src)
+{
+  struct id_entry *n = id_find_absent(a, cat, id_pair(id1, id2), id_pair(id3, id4));
+  return n && (n->absent & (1 << src));
+}
+
+void
+pci_id_set_absent(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, enum id_entry_src src)
+{
+  u32 id12 = id_pair(id1, id2);
+  u32 id34 = id_pair(id3, id4);
+  struct id_entry *n = id_find_absent(a, cat, id12, id34);
+  unsigned int h;
+
+  if (!n)
+    {
+      n = id_alloc(a, sizeof(struct id_entry));
+      h = id_hash(cat, id12, id34);
+      n->id12 = id12;
+      n->id34 = id34;
+      n->cat = cat;
+      n->src = SRC_ABSENT;
+      n->absent = 0;
+      n->name[0] = 0;
+      n->next = a->id_hash[h];
+      a->id_hash[h] = n;
+    }
+  n->absent |= 1 << src;
+}
+
 void
 pci_id_hash_free(struct pci_access *a)
 {
@@ -20,14 +20,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+static int
+hwdb_disabled(struct pci_access *a)
+{
+  const char *disabled = pci_get_param(a, "hwdb.disable");
+  return disabled && atoi(disabled);
+}
+
+static struct udev_list_entry *
+hwdb_query(struct pci_access *a, const char *modalias)
+{
+  if (!a->id_udev_hwdb)
+    {
+      a->debug("Initializing UDEV HWDB\n");
+      a->id_udev = udev_new();
+      a->id_udev_hwdb = udev_hwdb_new(a->id_udev);
+    }
+  a->id_hwdb_queries++;
+  return udev_hwdb_get_properties_list_entry(a->id_udev_hwdb, modalias, 0);
+}
+
 char *
 pci_id_hwdb_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4 UNUSED)
 {
   char modalias[64];
   const char *key = NULL;
 
-  const char *disabled = pci_get_param(a, "hwdb.disable");
-  if (disabled && atoi(disabled))
+  if (hwdb_disabled(a))
     return NULL;
 
   switch (cat)
@@ -67,15 +86,8 @@ pci_id_hwdb_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int
 
   if (key)
     {
-      if (!a->id_udev_hwdb)
-	{
-	  a->debug("Initializing UDEV HWDB\n");
-	  a->id_udev = udev_new();
-	  a->id_udev_hwdb = udev_hwdb_new(a->id_udev);
-	}
-
       struct udev_list_entry *entry;
-      udev_list_entry_foreach(entry, udev_hwdb_get_properties_list_entry(a->id_udev_hwdb, modalias, 0))
+      udev_list_entry_foreach(entry, hwdb_query(a, modalias))
 	{
 	  const char *entry_name = udev_list_entry_get_name(entry);
 	  if (entry_name && !strcmp(entry_name, key))
@@ -90,9 +102,58 @@ pci_id_hwdb_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int
   return NULL;
 }
 
+/*
+ *  Look up all names of a single device by one query. The modalias is built
+ *  such that the hwdb patterns for the vendor, the device and the class
+ *  (if known, i.e., cls >= 0) together with its parts all match it. The subsystem
+ *  is left as a wildcard, so that we do not get subsystem-specific model names.
+ *  The names are returned in names[ID_VENDOR..ID_PROGIF].
+ */
+int
+pci_id_hwdb_lookup_device(struct pci_access *a, int vendor, int device, int cls, int progif, char **names)
+{
+  static const struct { int cat; const char *key; } keys[] = {
+    { ID_VENDOR,	"ID_VENDOR_FROM_DATABASE" },
+    { ID_DEVICE,	"ID_MODEL_FROM_DATABASE" },
+    { ID_CLASS,		"ID_PCI_CLASS_FROM_DATABASE" },
+    { ID_SUBCLASS,	"ID_PCI_SUBCLASS_FROM_DATABASE" },
+    { ID_PROGIF,	"ID_PCI_INTERFACE_FROM_DATABASE" },
+  };
+  char modalias[64], *m;
+  struct udev_list_entry *entry;
+  unsigned int i;
+
+  for (i=0; i<=ID_PROGIF; i++)
+    names[i] = NULL;
+  if (hwdb_disabled(a))
+    return 0;
+
+  m = modalias + sprintf(modalias, "pci:v%08Xd%08Xsv*sd*", vendor, device);
+  if (cls >= 0)
+    {
+      m += sprintf(m, "bc%02Xsc%02X", cls >> 8, cls & 0xff);
+      if (progif >= 0)
+	sprintf(m, "i%02X", progif);
+    }
+
+  udev_list_entry_foreach(entry, hwdb_query(a, modalias))
+    {
+      const char *entry_name = udev_list_entry_get_name(entry);
+      const char *entry_value = udev_list_entry_get_value(entry);
+      if (!entry_name || !entry_value)
+	continue;
+      for (i=0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	if (!strcmp(entry_name, keys[i].key) && !names[keys[i].cat])
+	  names[keys[i].cat] = pci_strdup(a, entry_value);
+    }
+  return 1;
+}
+
 void
 pci_id_hwdb_free(struct pci_access *a)
 {
+  if (a->id_hwdb_queries)
+    a->debug("HWDB: %u queries, %u saved by prefetching\n", a->id_hwdb_queries, a->id_hwdb_saved);
   if (a->id_udev_hwdb)
     {
       udev_hwdb_unref(a->id_udev_hwdb);
@@ -113,6 +174,12 @@ pci_id_hwdb_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED,
   return NULL;
 }
 
+int
+pci_id_hwdb_lookup_device(struct pci_access *a UNUSED, int vendor UNUSED, int device UNUSED, int cls UNUSED, int progif UNUSED, char **names UNUSED)
+{
+  return 0;
+}
+
 void
 pci_id_hwdb_free(struct pci_access *a UNUSED)
 {
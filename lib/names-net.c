@@ -25,10 +25,20 @@
 #undef BYTE_ORDER
 #endif
 
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#if defined(PCI_OS_LINUX) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 25)
+#include <sys/random.h>
+#endif
 
 /*
  * Unfortunately, there are no portable functions for DNS RR parsing,
@@ -158,19 +168,14 @@ err:
   return -1;
 }
 
-char
-*pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4)
+static int
+dns_query_name(struct pci_access *a, char *dnsname, int cat, int id1, int id2, int id3, int id4)
 {
-  static int resolver_inited;
-  char name[256], dnsname[256], txt[256], *domain;
-  byte answer[4096];
-  const byte *data;
-  int res, j, dlen;
-  struct dns_state ds;
+  char name[256], *domain;
 
   domain = pci_get_param(a, "net.domain");
   if (!domain || !domain[0])
-    return NULL;
+    return 0;
 
   switch (cat)
     {
@@ -196,23 +201,22 @@ char
       sprintf(name, "%02x.%02x.%02x.c", id3, id2, id1);
       break;
     default:
-      return NULL;
+      return 0;
     }
   sprintf(dnsname, "%.100s.%.100s", name, domain);
+  return 1;
+}
 
-  a->debug("Resolving %s\n", dnsname);
-  if (!resolver_inited)
-    {
-      resolver_inited = 1;
-      res_init();
-    }
-  res = res_query(dnsname, ns_c_in, ns_t_txt, answer, sizeof(answer));
-  if (res < 0)
-    {
-      a->debug("\tfailed, h_errno=%d\n", h_errno);
-      return NULL;
-    }
-  if (dns_parse_packet(&ds, answer, res) < 0)
+/* Find the name in TXT records of the answer. If there is none, the ID is not known. */
+static char *
+dns_find_name(struct pci_access *a, byte *answer, int len, int *absent)
+{
+  char txt[256];
+  const byte *data;
+  int j, dlen;
+  struct dns_state ds;
+
+  if (dns_parse_packet(&ds, answer, len) < 0)
     {
       a->debug("\tMalformed DNS packet received\n");
       return NULL;
@@ -239,14 +243,345 @@ char
 	}
     }
 
+  *absent = 1;
   return NULL;
 }
 
+static void
+dns_init_resolver(void)
+{
+  static int resolver_inited;
+
+  if (!resolver_inited)
+    {
+      resolver_inited = 1;
+      res_init();
+    }
+}
+
+/*
+ *  If the DNS does not work (as opposed to not knowing the ID), we give up
+ *  for the rest of the session instead of waiting for a timeout again and again.
+ */
+static void
+dns_failed(struct pci_access *a)
+{
+  if (!a->id_net_failed)
+    a->debug("DNS does not respond properly, giving up\n");
+  a->id_net_failed = 1;
+}
+
+char *
+pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, int *absent)
+{
+  char dnsname[256];
+  byte answer[4096];
+  int res;
+
+  *absent = 0;
+  if (a->id_net_failed || !dns_query_name(a, dnsname, cat, id1, id2, id3, id4))
+    return NULL;
+
+  a->debug("Resolving %s\n", dnsname);
+  dns_init_resolver();
+  res = res_query(dnsname, ns_c_in, ns_t_txt, answer, sizeof(answer));
+  if (res < 0)
+    {
+      a->debug("\tfailed, h_errno=%d\n", h_errno);
+      if (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA)
+	*absent = 1;
+      else
+	dns_failed(a);
+      return NULL;
+    }
+  return dns_find_name(a, answer, res, absent);
+}
+
+/*
+ *  Batched lookups: all queries are sent at once over a single UDP socket
+ *  and the answers are matched by their ID and question. We talk to the
+ *  IPv4 servers configured in the resolver (or to net.server if set), trying
+ *  them in turn like res_query() does. Whatever cannot be handled this way
+ *  is passed to pci_id_net_lookup().
+ */
+
+#define DNS_MAX_SERVERS 4
+
+struct dns_server {
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+
+struct dns_pending {
+  char dnsname[256];
+  byte req[512];
+  int req_len;
+  int done;
+  int fallback;
+};
+
+static int
+dns_server_spec(struct pci_access *a, char *spec, struct dns_server *srv)
+{
+  char host[256], *h, *port, *p;
+  struct addrinfo hints, *res;
+
+  /* Accepted forms: address, IPv4:port, [IPv6]:port */
+  if (strlen(spec) >= sizeof(host))
+    goto bad;
+  strcpy(host, spec);
+  h = host;
+  port = "53";
+  if (host[0] == '[')
+    {
+      if (!(p = strchr(host, ']')))
+	goto bad;
+      *p++ = 0;
+      h = host + 1;
+      if (*p == ':')
+	port = p + 1;
+      else if (*p)
+	goto bad;
+    }
+  else if ((p = strchr(host, ':')) && !strchr(p+1, ':'))
+    {
+      *p = 0;
+      port = p + 1;
+    }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(h, port, &hints, &res))
+    goto bad;
+  memcpy(&srv->addr, res->ai_addr, res->ai_addrlen);
+  srv->len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 1;
+
+bad:
+  a->warning("Invalid DNS server address %s", spec);
+  return 0;
+}
+
+static int
+dns_servers(struct pci_access *a, struct dns_server *srv)
+{
+  char *spec = pci_get_param(a, "net.server");
+  int i, n;
+
+  if (spec && spec[0])
+    return dns_server_spec(a, spec, srv);
+
+  /* IPv6 servers are not exposed in a portable way, so we leave them to res_query() */
+  n = 0;
+  for (i=0; i < _res.nscount && n < DNS_MAX_SERVERS; i++)
+    if (_res.nsaddr_list[i].sin_family == AF_INET)
+      {
+	memset(&srv[n].addr, 0, sizeof(srv[n].addr));
+	memcpy(&srv[n].addr, &_res.nsaddr_list[i], sizeof(struct sockaddr_in));
+	srv[n].len = sizeof(struct sockaddr_in);
+	n++;
+      }
+  return n;
+}
+
+static int
+dns_server_match(struct dns_server *srv, int nsrv, struct sockaddr_storage *from)
+{
+  int i;
+
+  for (i=0; i<nsrv; i++)
+    {
+      if (srv[i].addr.ss_family != from->ss_family)
+	continue;
+      if (from->ss_family == AF_INET)
+	{
+	  struct sockaddr_in *x = (struct sockaddr_in *) &srv[i].addr, *y = (struct sockaddr_in *) from;
+	  if (x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr)
+	    return 1;
+	}
+      else if (from->ss_family == AF_INET6)
+	{
+	  struct sockaddr_in6 *x = (struct sockaddr_in6 *) &srv[i].addr, *y = (struct sockaddr_in6 *) from;
+	  if (x->sin6_port == y->sin6_port && !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)))
+	    return 1;
+	}
+    }
+  return 0;
+}
+
+/*
+ *  The query ID is all that protects us from forged answers, so it has to be
+ *  unpredictable. If the system has no suitable random source, we keep the ID
+ *  chosen by res_mkquery().
+ */
+static void
+dns_random_id(byte *req)
+{
+#if defined(PCI_OS_LINUX) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 25)
+  byte id[2];
+  if (getrandom(id, 2, GRND_NONBLOCK) == 2)
+    memcpy(req, id, 2);
+#elif defined(PCI_OS_FREEBSD) || defined(PCI_OS_NETBSD) || defined(PCI_OS_OPENBSD) || defined(PCI_OS_DRAGONFLY) || defined(PCI_OS_DARWIN)
+  arc4random_buf(req, 2);
 #else
+  (void) req;
+#endif
+}
 
-char *pci_id_net_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED, int id2 UNUSED, int id3 UNUSED, int id4 UNUSED)
+static int
+dns_batch_answer(struct pci_access *a, struct id_net_query *q, struct dns_pending *pend, int n, byte *buf, int len)
 {
+  char qname[256];
+  int i, rcode;
+
+  if (len < 12 || !(buf[2] & 0x80) || ((buf[4] << 8) | buf[5]) != 1)
+    return 0;
+  if (dn_expand(buf, buf + len, buf + 12, qname, sizeof(qname)) < 0)
+    return 0;
+  for (i=0; i<n; i++)
+    if (!pend[i].done && pend[i].req[0] == buf[0] && pend[i].req[1] == buf[1] &&
+	!strcasecmp(qname, pend[i].dnsname))
+      break;
+  if (i >= n)
+    return 0;
+
+  pend[i].done = 1;
+  rcode = buf[3] & 0x0f;
+  a->debug("Answer for %s: rcode=%d\n", pend[i].dnsname, rcode);
+  if (buf[2] & 0x02)
+    pend[i].fallback = 1;	/* Truncated, let the resolver retry over TCP */
+  else if (rcode == ns_r_noerror)
+    q[i].name = dns_find_name(a, buf, len, &q[i].absent);
+  else if (rcode == ns_r_nxdomain)
+    q[i].absent = 1;
+  else
+    pend[i].fallback = 1;	/* Server failure, the resolver might have better luck */
+  return 1;
+}
+
+static long long
+dns_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+pci_id_net_lookup_batch(struct pci_access *a, struct id_net_query *q, int n)
+{
+  struct dns_server srv[DNS_MAX_SERVERS];
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct dns_pending *pend;
+  struct pollfd pfd;
+  byte buf[4096];
+  int fd, i, s, nsrv, len, pending, round, rounds, timeout;
+  long long deadline, left;
+
+  for (i=0; i<n; i++)
+    {
+      q[i].name = NULL;
+      q[i].absent = 0;
+    }
+  if (!n || a->id_net_failed)
+    return;
+
+  dns_init_resolver();
+  fd = -1;
+  nsrv = 0;
+  if (n > 1 && (nsrv = dns_servers(a, srv)))
+    fd = socket(srv[0].addr.ss_family, SOCK_DGRAM, 0);
+  if (fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+      if (fd >= 0)
+	close(fd);
+      for (i=0; i<n; i++)
+	q[i].name = pci_id_net_lookup(a, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4, &q[i].absent);
+      return;
+    }
+
+  pend = pci_malloc(a, n * sizeof(struct dns_pending));
+  pending = 0;
+  for (i=0; i<n; i++)
+    {
+      struct dns_pending *p = &pend[i];
+      p->done = 1;
+      p->fallback = 0;
+      if (!dns_query_name(a, p->dnsname, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4))
+	continue;
+      p->req_len = res_mkquery(ns_o_query, p->dnsname, ns_c_in, ns_t_txt, NULL, 0, NULL, p->req, sizeof(p->req));
+      if (p->req_len < 12)
+	continue;
+      dns_random_id(p->req);
+      p->done = 0;
+      pending++;
+    }
+
+  timeout = (_res.retrans > 0 ? _res.retrans : 5) * 1000;
+  rounds = (_res.retry > 0 ? _res.retry : 2);
+  for (round=0; round < rounds && pending; round++)
+    for (s=0; s < nsrv && pending; s++)
+      {
+	if (srv[s].addr.ss_family != srv[0].addr.ss_family)
+	  continue;
+	for (i=0; i<n; i++)
+	  if (!pend[i].done)
+	    {
+	      a->debug("%s %s\n", ((round || s) ? "Retrying" : "Resolving"), pend[i].dnsname);
+	      sendto(fd, pend[i].req, pend[i].req_len, 0, (struct sockaddr *) &srv[s].addr, srv[s].len);
+	    }
+	/* Late answers from the servers we have already tried are welcome, too */
+	deadline = dns_now_ms() + timeout;
+	while (pending && (left = deadline - dns_now_ms()) > 0)
+	  {
+	    pfd.fd = fd;
+	    pfd.events = POLLIN;
+	    if (poll(&pfd, 1, (left < timeout) ? (int) left : timeout) <= 0)
+	      {
+		if (errno == EINTR)
+		  continue;
+		break;
+	      }
+	    fromlen = sizeof(from);
+	    while ((len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen)) > 0)
+	      {
+		if (dns_server_match(srv, nsrv, &from))
+		  pending -= dns_batch_answer(a, q, pend, n, buf, len);
+		fromlen = sizeof(from);
+	      }
+	  }
+      }
+  close(fd);
+
+  /* Whatever remains goes through the resolver, which decides if DNS is broken */
+  if (pending)
+    a->debug("%d DNS queries timed out, falling back to the resolver\n", pending);
+  for (i=0; i<n; i++)
+    if (!pend[i].done || pend[i].fallback)
+      q[i].name = pci_id_net_lookup(a, q[i].cat, q[i].id1, q[i].id2, q[i].id3, q[i].id4, &q[i].absent);
+  pci_mfree(pend);
+}
+
+#else
+
+char *pci_id_net_lookup(struct pci_access *a UNUSED, int cat UNUSED, int id1 UNUSED, int id2 UNUSED, int id3 UNUSED, int id4 UNUSED, int *absent)
+{
+  *absent = 0;
   return NULL;
 }
 
+void pci_id_net_lookup_batch(struct pci_access *a UNUSED, struct id_net_query *q, int n)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+    {
+      q[i].name = NULL;
+      q[i].absent = 0;
+    }
+}
+
 #endif
@@ -16,11 +16,23 @@
 #include "internal.h"
 #include "names.h"
 
+#ifdef PCI_HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #ifdef PCI_COMPRESSED_IDS
 #include <zlib.h>
 typedef gzFile pci_file;
-#define pci_gets(f, l, s)	gzgets(f, l, s)
-#define pci_eof(f)		gzeof(f)
+#define pci_read(f, b, l)	gzread(f, b, l)
 
 static pci_file pci_open(struct pci_access *a)
 {
@@ -52,8 +64,7 @@ static pci_file pci_open(struct pci_access *a)
 	}
 #else
 typedef FILE * pci_file;
-#define pci_gets(f, l, s)	fgets(l, s, f)
-#define pci_eof(f)		feof(f)
+#define pci_read(f, b, l)	fread(b, 1, l, f)
 #define pci_open(a)		fopen(a->id_file_name, "r")
 #define pci_close(f)		fclose(f)
 #define PCI_ERROR(f, err)	if (!err && ferror(f))	err = "I/O error";
@@ -84,153 +95,722 @@ static inline int id_white_p(int c)
 }
 
 
-static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
+struct id_parse_state {
+  int id1, id2, id3, id4;
+  int cat;
+  struct id_arena *arena;		/* If non-NULL, entries go there instead of to the hash */
+  int lino;				/* Current line (needed only with arenas) */
+};
+
+static void id_parse_init(struct id_parse_state *s)
+{
+  s->id1 = s->id2 = s->id3 = s->id4 = 0;
+  s->cat = -1;
+  s->arena = NULL;
+  s->lino = 0;
+}
+
+/* Strip the line terminator and trailing whitespace, return 0 if there was no terminator */
+static int id_chomp(char *line)
+{
+  char *p = line;
+  int complete;
+
+  while (*p && *p != '\n' && *p != '\r')
+    p++;
+  complete = (*p != 0);
+  *p = 0;
+  if (p > line && (p[-1] == ' ' || p[-1] == '\t'))
+    *--p = 0;
+  return complete;
+}
+
+static int id_lazy_has_vendor(struct pci_access *a, int id);
+
+static const char *id_parse_line(struct pci_access *a, struct id_parse_state *s, char *line)
 {
-  char line[MAX_LINE];
   char *p;
-  int id1=0, id2=0, id3=0, id4=0;
-  int cat = -1;
   int nest;
   static const char parse_error[] = "Parse error";
 
+  p = line;
+  while (id_white_p(*p))
+    p++;
+  if (!*p || *p == '#')
+    return NULL;
+
+  p = line;
+  while (*p == '\t')
+    p++;
+  nest = p - line;
+
+  if (!nest)					/* Top-level entries */
+    {
+      if (p[0] == 'C' && p[1] == ' ')		/* Class block */
+	{
+	  if ((s->id1 = id_hex(p+2, 2)) < 0 || !id_white_p(p[4]))
+	    return parse_error;
+	  s->cat = ID_CLASS;
+	  p += 5;
+	}
+      else if (p[0] == 'S' && p[1] == ' ')
+	{						/* Generic subsystem block */
+	  if ((s->id1 = id_hex(p+2, 4)) < 0 || p[6])
+	    return parse_error;
+	  if (s->arena)				/* Checked when merging the arena */
+	    pci_id_arena_add(a, s->arena, s->lino, ID_UNKNOWN, s->id1, 0, 0, 0, "");
+	  else if (a->id_lazy ? !id_lazy_has_vendor(a, s->id1) : !pci_id_lookup(a, 0, ID_VENDOR, s->id1, 0, 0, 0))
+	    return "Vendor does not exist";
+	  s->cat = ID_GEN_SUBSYSTEM;
+	  return NULL;
+	}
+      else if (p[0] >= 'A' && p[0] <= 'Z' && p[1] == ' ')
+	{						/* Unrecognized block (RFU) */
+	  s->cat = ID_UNKNOWN;
+	  return NULL;
+	}
+      else						/* Vendor ID */
+	{
+	  if ((s->id1 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
+	    return parse_error;
+	  s->cat = ID_VENDOR;
+	  p += 5;
+	}
+      s->id2 = s->id3 = s->id4 = 0;
+    }
+  else if (s->cat == ID_UNKNOWN)		/* Nested entries in RFU blocks are skipped */
+    return NULL;
+  else if (nest == 1)				/* Nesting level 1 */
+    switch (s->cat)
+      {
+      case ID_VENDOR:
+      case ID_DEVICE:
+      case ID_SUBSYSTEM:
+	if ((s->id2 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
+	  return parse_error;
+	p += 5;
+	s->cat = ID_DEVICE;
+	s->id3 = s->id4 = 0;
+	break;
+      case ID_GEN_SUBSYSTEM:
+	if ((s->id2 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
+	  return parse_error;
+	p += 5;
+	s->id3 = s->id4 = 0;
+	break;
+      case ID_CLASS:
+      case ID_SUBCLASS:
+      case ID_PROGIF:
+	if ((s->id2 = id_hex(p, 2)) < 0 || !id_white_p(p[2]))
+	  return parse_error;
+	p += 3;
+	s->cat = ID_SUBCLASS;
+	s->id3 = s->id4 = 0;
+	break;
+      default:
+	return parse_error;
+      }
+  else if (nest == 2)				/* Nesting level 2 */
+    switch (s->cat)
+      {
+      case ID_DEVICE:
+      case ID_SUBSYSTEM:
+	if ((s->id3 = id_hex(p, 4)) < 0 || !id_white_p(p[4]) || (s->id4 = id_hex(p+5, 4)) < 0 || !id_white_p(p[9]))
+	  return parse_error;
+	p += 10;
+	s->cat = ID_SUBSYSTEM;
+	break;
+      case ID_CLASS:
+      case ID_SUBCLASS:
+      case ID_PROGIF:
+	if ((s->id3 = id_hex(p, 2)) < 0 || !id_white_p(p[2]))
+	  return parse_error;
+	p += 3;
+	s->cat = ID_PROGIF;
+	s->id4 = 0;
+	break;
+      default:
+	return parse_error;
+      }
+  else						/* Nesting level 3 or more */
+    return parse_error;
+  while (id_white_p(*p))
+    p++;
+  if (!*p)
+    return parse_error;
+  if (s->arena)
+    pci_id_arena_add(a, s->arena, s->lino, s->cat, s->id1, s->id2, s->id3, s->id4, p);
+  else if (pci_id_insert(a, s->cat, s->id1, s->id2, s->id3, s->id4, p, SRC_LOCAL))
+    return "Duplicate entry";
+  return NULL;
+}
+
+/*
+ *  The list is read in large blocks, which are split to lines in place.
+ *  This is much faster than calling gzgets() for every line, which has
+ *  a considerable overhead per call.
+ */
+
+#define ID_READ_BLOCK 65536
+
+struct id_reader {
+  pci_file f;
+  char buf[ID_READ_BLOCK + 1];
+  size_t pos, end;
+  int eof;
+};
+
+/* Return the next line without the newline; a line longer than MAX_LINE-1 is returned incomplete */
+static char *id_reader_gets(struct id_reader *r, int *complete)
+{
+  char *p, *nl;
+  size_t len;
+  int n;
+
+  for (;;)
+    {
+      p = r->buf + r->pos;
+      len = r->end - r->pos;
+      if (len > MAX_LINE - 1)
+	len = MAX_LINE - 1;
+      if (nl = memchr(p, '\n', len))
+	{
+	  *nl = 0;
+	  r->pos += nl - p + 1;
+	  *complete = 1;
+	  return p;
+	}
+      if (len == MAX_LINE - 1 || r->eof)
+	{
+	  if (!len)
+	    return NULL;
+	  p[len] = 0;
+	  r->pos += len;
+	  *complete = 0;
+	  return p;
+	}
+      memmove(r->buf, p, r->end - r->pos);
+      r->end -= r->pos;
+      r->pos = 0;
+      n = pci_read(r->f, r->buf + r->end, ID_READ_BLOCK - r->end);
+      if (n > 0)
+	r->end += n;
+      else
+	r->eof = 1;
+    }
+}
+
+static const char *id_parse_list(struct pci_access *a, pci_file f, int *lino)
+{
+  struct id_reader *r;
+  struct id_parse_state s;
+  const char *err = NULL;
+  char *line;
+  int complete;
+
+  r = pci_malloc(a, sizeof(struct id_reader));
+  r->f = f;
+  r->pos = r->end = 0;
+  r->eof = 0;
+  id_parse_init(&s);
   *lino = 0;
-  while (pci_gets(f, line, sizeof(line)))
+  while (line = id_reader_gets(r, &complete))
     {
       (*lino)++;
-      p = line;
-      while (*p && *p != '\n' && *p != '\r')
-	p++;
-      if (!*p && !pci_eof(f))
-	return "Line too long";
-      *p = 0;
-      if (p > line && (p[-1] == ' ' || p[-1] == '\t'))
-	*--p = 0;
+      id_chomp(line);
+      if (!complete && !r->eof)
+	{
+	  err = "Line too long";
+	  break;
+	}
+      if (err = id_parse_line(a, &s, line))
+	break;
+    }
+  pci_mfree(r);
+  return err;
+}
 
-      p = line;
-      while (id_white_p(*p))
-	p++;
-      if (!*p || *p == '#')
-	continue;
+/*
+ *  Both the lazy mode and the parallel parser work on the whole text
+ *  of the ID list in memory. It is mapped if it is not compressed.
+ */
 
-      p = line;
-      while (*p == '\t')
-	p++;
-      nest = p - line;
+struct id_text {
+  char *data;
+  size_t size;
+  int mapped;
+};
+
+static int id_text_read(struct pci_access *a, struct id_text *t)
+{
+  pci_file f;
+  size_t alloc;
+  int n;
+  const char *err = NULL;
 
-      if (!nest)					/* Top-level entries */
+#ifdef PCI_HAVE_MMAP
+  int fd = open(a->id_file_name, O_RDONLY);
+  if (fd >= 0)
+    {
+      struct stat st;
+      void *map = MAP_FAILED;
+      if (fstat(fd, &st) >= 0 && st.st_size > 0)
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map != MAP_FAILED)
 	{
-	  if (p[0] == 'C' && p[1] == ' ')		/* Class block */
-	    {
-	      if ((id1 = id_hex(p+2, 2)) < 0 || !id_white_p(p[4]))
-		return parse_error;
-	      cat = ID_CLASS;
-	      p += 5;
-	    }
-	  else if (p[0] == 'S' && p[1] == ' ')
-	    {						/* Generic subsystem block */
-	      if ((id1 = id_hex(p+2, 4)) < 0 || p[6])
-		return parse_error;
-	      if (!pci_id_lookup(a, 0, ID_VENDOR, id1, 0, 0, 0))
-		return "Vendor does not exist";
-	      cat = ID_GEN_SUBSYSTEM;
-	      continue;
-	    }
-	  else if (p[0] >= 'A' && p[0] <= 'Z' && p[1] == ' ')
-	    {						/* Unrecognized block (RFU) */
-	      cat = ID_UNKNOWN;
-	      continue;
-	    }
-	  else						/* Vendor ID */
+#ifdef PCI_COMPRESSED_IDS
+	  byte *magic = map;
+	  if (st.st_size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+	    munmap(map, st.st_size);		/* Compressed, needs to be read */
+	  else
+#endif
 	    {
-	      if ((id1 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
-		return parse_error;
-	      cat = ID_VENDOR;
-	      p += 5;
+	      t->data = map;
+	      t->size = st.st_size;
+	      t->mapped = 1;
+	      return 1;
 	    }
-	  id2 = id3 = id4 = 0;
 	}
-      else if (cat == ID_UNKNOWN)			/* Nested entries in RFU blocks are skipped */
-	continue;
-      else if (nest == 1)				/* Nesting level 1 */
-	switch (cat)
-	  {
-	  case ID_VENDOR:
-	  case ID_DEVICE:
-	  case ID_SUBSYSTEM:
-	    if ((id2 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
-	      return parse_error;
-	    p += 5;
-	    cat = ID_DEVICE;
-	    id3 = id4 = 0;
-	    break;
-	  case ID_GEN_SUBSYSTEM:
-	    if ((id2 = id_hex(p, 4)) < 0 || !id_white_p(p[4]))
-	      return parse_error;
-	    p += 5;
-	    id3 = id4 = 0;
-	    break;
-	  case ID_CLASS:
-	  case ID_SUBCLASS:
-	  case ID_PROGIF:
-	    if ((id2 = id_hex(p, 2)) < 0 || !id_white_p(p[2]))
-	      return parse_error;
-	    p += 3;
-	    cat = ID_SUBCLASS;
-	    id3 = id4 = 0;
-	    break;
-	  default:
-	    return parse_error;
-	  }
-      else if (nest == 2)				/* Nesting level 2 */
-	switch (cat)
-	  {
-	  case ID_DEVICE:
-	  case ID_SUBSYSTEM:
-	    if ((id3 = id_hex(p, 4)) < 0 || !id_white_p(p[4]) || (id4 = id_hex(p+5, 4)) < 0 || !id_white_p(p[9]))
-	      return parse_error;
-	    p += 10;
-	    cat = ID_SUBSYSTEM;
-	    break;
-	  case ID_CLASS:
-	  case ID_SUBCLASS:
-	  case ID_PROGIF:
-	    if ((id3 = id_hex(p, 2)) < 0 || !id_white_p(p[2]))
-	      return parse_error;
-	    p += 3;
-	    cat = ID_PROGIF;
-	    id4 = 0;
-	    break;
-	  default:
-	    return parse_error;
-	  }
-      else						/* Nesting level 3 or more */
-	return parse_error;
+    }
+#endif
+
+  if (!(f = pci_open(a)))
+    return 0;
+  alloc = 65536;
+  t->data = pci_malloc(a, alloc);
+  t->size = 0;
+  t->mapped = 0;
+  while ((n = pci_read(f, t->data + t->size, alloc - t->size)) > 0)
+    {
+      t->size += n;
+      if (t->size == alloc)
+	{
+	  alloc *= 2;
+	  t->data = pci_realloc(a, t->data, alloc);
+	}
+    }
+  PCI_ERROR(f, err);
+  pci_close(f);
+  if (err)
+    a->error("%s while reading %s\n", err, a->id_file_name);
+  return 1;
+}
+
+/* Like fgets(), but reading from the in-memory text */
+static char *id_text_gets(struct id_text *t, size_t *pos, size_t end, char *line, int size)
+{
+  char *p = t->data + *pos;
+  char *nl;
+  size_t len;
+
+  if (*pos >= end)
+    return NULL;
+  len = end - *pos;
+  if (len > (size_t) size - 1)
+    len = size - 1;
+  if (nl = memchr(p, '\n', len))
+    len = nl - p + 1;
+  memcpy(line, p, len);
+  line[len] = 0;
+  *pos += len;
+  return line;
+}
+
+static void id_text_free(struct id_text *t)
+{
+#ifdef PCI_HAVE_MMAP
+  if (t->mapped)
+    munmap(t->data, t->size);
+  else
+#endif
+    pci_mfree(t->data);
+}
+
+/*
+ *  In the lazy mode, we keep the text of the ID list in memory together
+ *  with an index of its top-level blocks. Each block is parsed when an ID
+ *  from it is looked up for the first time. As most programs need names
+ *  of only a handful of vendors, this saves most of the parsing time and memory.
+ */
+
+struct id_lazy_block {
+  u16 id;
+  byte cat;				/* ID_VENDOR, ID_CLASS or ID_GEN_SUBSYSTEM */
+  byte loaded;
+  int lino;				/* Line number of the block header */
+  size_t start, end;			/* Position of the block in the text */
+};
+
+struct id_lazy {
+  struct id_text text;
+  struct id_lazy_block *blocks;		/* Sorted by (cat, id) */
+  int num_blocks;
+};
+
+static int id_lazy_enabled(struct pci_access *a)
+{
+  char *mode = pci_get_param(a, "names.lazy");
+  return mode && atoi(mode) > 0;
+}
+
+static int id_lazy_compare(const void *A, const void *B)
+{
+  const struct id_lazy_block *a = A, *b = B;
+  if (a->cat != b->cat)
+    return a->cat - b->cat;
+  return a->id - b->id;
+}
+
+static struct id_lazy_block *id_lazy_find(struct id_lazy *l, int cat, int id)
+{
+  struct id_lazy_block key;
+  key.cat = cat;
+  key.id = id;
+  return bsearch(&key, l->blocks, l->num_blocks, sizeof(struct id_lazy_block), id_lazy_compare);
+}
+
+static int id_lazy_has_vendor(struct pci_access *a, int id)
+{
+  return id_lazy_find(a->id_lazy, ID_VENDOR, id) != NULL;
+}
+
+/* Find all top-level blocks, checking their headers on the way */
+static const char *id_lazy_index(struct pci_access *a, struct id_lazy *l, int *lino)
+{
+  char line[MAX_LINE], *p;
+  size_t pos = 0, start;
+  int alloc = 256;
+  struct id_lazy_block *b, *last = NULL;
+  int cat, id, i;
+
+  l->blocks = pci_malloc(a, alloc * sizeof(struct id_lazy_block));
+  l->num_blocks = 0;
+  *lino = 0;
+  for (;;)
+    {
+      start = pos;
+      if (!id_text_gets(&l->text, &pos, l->text.size, line, sizeof(line)))
+	break;
+      (*lino)++;
+      if (!id_chomp(line) && pos < l->text.size)
+	return "Line too long";
+      p = line;
       while (id_white_p(*p))
 	p++;
-      if (!*p)
-	return parse_error;
-      if (pci_id_insert(a, cat, id1, id2, id3, id4, p, SRC_LOCAL))
+      if (!*p || *p == '#' || line[0] == '\t')
+	continue;
+
+      if (last)
+	last->end = start;
+      last = NULL;
+      if (line[0] == 'C' && line[1] == ' ')
+	{
+	  if ((id = id_hex(line+2, 2)) < 0 || !id_white_p(line[4]))
+	    return "Parse error";
+	  cat = ID_CLASS;
+	}
+      else if (line[0] == 'S' && line[1] == ' ')
+	{
+	  if ((id = id_hex(line+2, 4)) < 0 || line[6])
+	    return "Parse error";
+	  cat = ID_GEN_SUBSYSTEM;
+	}
+      else if (line[0] >= 'A' && line[0] <= 'Z' && line[1] == ' ')
+	continue;
+      else
+	{
+	  if ((id = id_hex(line, 4)) < 0 || !id_white_p(line[4]))
+	    return "Parse error";
+	  cat = ID_VENDOR;
+	}
+
+      if (l->num_blocks == alloc)
+	{
+	  alloc *= 2;
+	  l->blocks = pci_realloc(a, l->blocks, alloc * sizeof(struct id_lazy_block));
+	}
+      last = b = &l->blocks[l->num_blocks++];
+      b->id = id;
+      b->cat = cat;
+      b->loaded = 0;
+      b->lino = *lino;
+      b->start = start;
+    }
+  if (last)
+    last->end = l->text.size;
+
+  qsort(l->blocks, l->num_blocks, sizeof(struct id_lazy_block), id_lazy_compare);
+  for (i=1; i<l->num_blocks; i++)
+    if (!id_lazy_compare(&l->blocks[i-1], &l->blocks[i]))
+      {
+	b = &l->blocks[i];
+	*lino = (b->lino > b[-1].lino) ? b->lino : b[-1].lino;
 	return "Duplicate entry";
+      }
+  return NULL;
+}
+
+static int id_lazy_open(struct pci_access *a)
+{
+  struct id_lazy *l = pci_malloc(a, sizeof(struct id_lazy));
+  const char *err;
+  int lino;
+
+  memset(l, 0, sizeof(*l));
+  if (!id_text_read(a, &l->text))
+    {
+      pci_mfree(l);
+      return 0;
+    }
+  a->id_lazy = l;
+  err = id_lazy_index(a, l, &lino);
+  if (err)
+    a->error("%s at %s, line %d\n", err, a->id_file_name, lino);
+  a->debug("Lazy loading of %s: indexed %d blocks\n", a->id_file_name, l->num_blocks);
+  return 1;
+}
+
+void
+pci_id_lazy_load(struct pci_access *a, int cat, int id1)
+{
+  struct id_lazy *l = a->id_lazy;
+  struct id_lazy_block *b;
+  struct id_parse_state s;
+  char line[MAX_LINE];
+  const char *err = NULL;
+  size_t pos;
+  int lino;
+
+  switch (cat)
+    {
+    case ID_VENDOR:
+    case ID_DEVICE:
+    case ID_SUBSYSTEM:
+      cat = ID_VENDOR;
+      break;
+    case ID_CLASS:
+    case ID_SUBCLASS:
+    case ID_PROGIF:
+      cat = ID_CLASS;
+      break;
+    }
+  b = id_lazy_find(l, cat, id1);
+  if (!b || b->loaded)
+    return;
+  b->loaded = 1;
+
+  id_parse_init(&s);
+  pos = b->start;
+  lino = b->lino - 1;
+  while (!err && id_text_gets(&l->text, &pos, b->end, line, sizeof(line)))
+    {
+      lino++;
+      if (!id_chomp(line) && pos < l->text.size)
+	err = "Line too long";
+      else
+	err = id_parse_line(a, &s, line);
+    }
+  if (err)
+    a->error("%s at %s, line %d\n", err, a->id_file_name, lino);
+}
+
+static void id_lazy_free(struct pci_access *a)
+{
+  struct id_lazy *l = a->id_lazy;
+
+  if (!l)
+    return;
+  id_text_free(&l->text);
+  pci_mfree(l->blocks);
+  pci_mfree(l);
+  a->id_lazy = NULL;
+}
+
+#ifdef PCI_HAVE_PTHREADS
+
+/*
+ *  The parallel parser splits the text to chunks at boundaries of top-level
+ *  blocks and parses each chunk by a separate thread to a private arena.
+ *  The arenas are then merged in the original order, so both the contents
+ *  of the hash and the errors reported are the same as with the sequential
+ *  parser.
+ */
+
+#define ID_MIN_CHUNK 65536
+
+struct id_chunk {
+  struct pci_access *a;
+  struct id_text *text;
+  size_t start, end;
+  struct id_arena arena;
+  int lines;				/* Number of lines parsed */
+  const char *err;			/* Error at the last line parsed */
+  pthread_t thread;
+  int running;
+};
+
+static int id_parse_threads(struct pci_access *a)
+{
+  char *param = pci_get_param(a, "names.threads");
+  int n = param ? atoi(param) : 1;
+
+  if (!n)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 64) ? n : 64;
+}
+
+static void *id_parse_chunk(void *arg)
+{
+  struct id_chunk *c = arg;
+  struct id_parse_state s;
+  char line[MAX_LINE];
+  size_t pos = c->start;
+
+  id_parse_init(&s);
+  s.arena = &c->arena;
+  while (!c->err && id_text_gets(c->text, &pos, c->end, line, sizeof(line)))
+    {
+      s.lino = ++c->lines;
+      if (!id_chomp(line) && pos < c->text->size)
+	c->err = "Line too long";
+      else
+	c->err = id_parse_line(c->a, &s, line);
     }
   return NULL;
 }
 
+/* Find the first top-level line starting at or after the given position */
+static size_t id_chunk_boundary(struct id_text *t, size_t pos)
+{
+  char *p;
+  int c;
+
+  while (pos > 0 && pos < t->size)
+    {
+      if (t->data[pos-1] == '\n')
+	{
+	  c = t->data[pos];
+	  if (c != '\t' && c != ' ' && c != '#' && c != '\n' && c != '\r')
+	    return pos;
+	}
+      if (!(p = memchr(t->data + pos, '\n', t->size - pos)))
+	break;
+      pos = p - t->data + 1;
+    }
+  return (pos < t->size) ? pos : t->size;
+}
+
+static const char *id_parse_parallel(struct pci_access *a, struct id_text *t, int threads, int *lino)
+{
+  struct id_chunk *chunks, *c;
+  struct id_arena_item *it;
+  const char *err = NULL;
+  size_t pos = 0;
+  int i, base = 0;
+
+  if ((size_t) threads > t->size / ID_MIN_CHUNK + 1)
+    threads = t->size / ID_MIN_CHUNK + 1;
+  chunks = pci_malloc(a, threads * sizeof(struct id_chunk));
+  memset(chunks, 0, threads * sizeof(struct id_chunk));
+  for (i=0; i<threads; i++)
+    {
+      c = &chunks[i];
+      c->a = a;
+      c->text = t;
+      c->start = pos;
+      if (i < threads-1)
+	pos = id_chunk_boundary(t, (pos > t->size / threads * (i+1)) ? pos : t->size / threads * (i+1));
+      else
+	pos = t->size;
+      c->end = pos;
+      pci_id_arena_init(&c->arena);
+      if (i > 0 && !pthread_create(&c->thread, NULL, id_parse_chunk, c))
+	c->running = 1;
+    }
+  a->debug("Parsing %s in %d chunks\n", a->id_file_name, threads);
+
+  /* The first chunk is parsed by us, and also all chunks whose threads failed to start */
+  for (i=0; i<threads; i++)
+    {
+      c = &chunks[i];
+      if (c->running)
+	pthread_join(c->thread, NULL);
+      else
+	id_parse_chunk(c);
+    }
+
+  *lino = 0;
+  for (i=0; i<threads && !err; i++)
+    {
+      c = &chunks[i];
+      for (it = c->arena.first; it && !err; it = it->next)
+	{
+	  *lino = base + it->lino;
+	  if (it->e.cat == ID_UNKNOWN)
+	    {
+	      if (!pci_id_lookup(a, 0, ID_VENDOR, pair_first(it->e.id12), 0, 0, 0))
+		err = "Vendor does not exist";
+	    }
+	  else if (pci_id_link(a, &it->e))
+	    err = "Duplicate entry";
+	}
+      if (!err && c->err)
+	{
+	  *lino = base + c->lines;
+	  err = c->err;
+	}
+      base += c->lines;
+    }
+
+  for (i=0; i<threads; i++)
+    pci_id_arena_adopt(a, &chunks[i].arena);
+  pci_mfree(chunks);
+  return err;
+}
+
+#endif
+
 int
 pci_load_name_list(struct pci_access *a)
 {
   pci_file f;
   int lino;
   const char *err;
+#ifdef PCI_HAVE_PTHREADS
+  int threads;
+#endif
 
   pci_free_name_list(a);
   a->id_load_attempted = 1;
-  if (!(f = pci_open(a)))
-    return 0;
-  err = id_parse_list(a, f, &lino);
-  PCI_ERROR(f, err);
-  pci_close(f);
+  if (pci_id_bin_load(a))
+    return 1;
+  if (id_lazy_enabled(a))
+    return id_lazy_open(a);
+#ifdef PCI_HAVE_PTHREADS
+  if ((threads = id_parse_threads(a)) > 1)
+    {
+      struct id_text t;
+      if (!id_text_read(a, &t))
+	return 0;
+      err = id_parse_parallel(a, &t, threads, &lino);
+      id_text_free(&t);
+    }
+  else
+#endif
+    {
+      if (!(f = pci_open(a)))
+	return 0;
+      err = id_parse_list(a, f, &lino);
+      PCI_ERROR(f, err);
+      pci_close(f);
+    }
+  pci_id_bin_build(a);
+  /* Never make a compiled copy of a list we failed to parse completely */
   if (err)
     a->error("%s at %s, line %d\n", err, a->id_file_name, lino);
+  else
+    pci_id_bin_save(a);
   return 1;
 }
 
@@ -239,6 +819,8 @@ pci_free_name_list(struct pci_access *a)
 {
   pci_id_cache_flush(a);
   pci_id_hash_free(a);
+  pci_id_bin_free(a);
+  id_lazy_free(a);
   pci_id_hwdb_free(a);
   a->id_load_attempted = 0;
 }
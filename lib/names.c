@@ -18,16 +18,25 @@
 static char *id_lookup(struct pci_access *a, int flags, int cat, int id1, int id2, int id3, int id4)
 {
   char *name;
-  int tried_hwdb = 0;
+  int tried_cache = 0, tried_hwdb = 0, tried_net = 0, absent;
 
+  if (a->id_lazy && !(flags & PCI_LOOKUP_SKIP_LOCAL))
+    pci_id_lazy_load(a, cat, id1);
   while (!(name = pci_id_lookup(a, flags, cat, id1, id2, id3, id4)))
     {
-      if ((flags & PCI_LOOKUP_CACHE) && !a->id_cache_status)
+      if ((flags & PCI_LOOKUP_CACHE) && !tried_cache)
 	{
-	  if (pci_id_cache_load(a, flags))
-	    continue;
+	  tried_cache = 1;
+	  if (!a->id_cache_status)
+	    pci_id_cache_load(a, flags);
+	  /* The cache is consulted in place, its entries are not copied to the hash */
+	  if (name = pci_id_cache_lookup(a, cat, id1, id2, id3, id4, &absent))
+	    return name;
+	  if (absent)
+	    pci_id_set_absent(a, cat, id1, id2, id3, id4, SRC_NET);
 	}
-      if (!tried_hwdb && !(flags & (PCI_LOOKUP_SKIP_LOCAL | PCI_LOOKUP_NO_HWDB)))
+      if (!tried_hwdb && !(flags & (PCI_LOOKUP_SKIP_LOCAL | PCI_LOOKUP_NO_HWDB)) &&
+	  !pci_id_absent(a, cat, id1, id2, id3, id4, SRC_HWDB))
 	{
 	  tried_hwdb = 1;
 	  if (name = pci_id_hwdb_lookup(a, cat, id1, id2, id3, id4))
@@ -36,19 +45,26 @@ static char *id_lookup(struct pci_access *a, int flags, int cat, int id1, int id
 	      pci_mfree(name);
 	      continue;
 	    }
+	  pci_id_set_absent(a, cat, id1, id2, id3, id4, SRC_HWDB);
 	}
-      if (flags & PCI_LOOKUP_NETWORK)
+      if (!tried_net && (flags & PCI_LOOKUP_NETWORK) &&
+	  !pci_id_absent(a, cat, id1, id2, id3, id4, SRC_NET))
         {
-	  if (name = pci_id_net_lookup(a, cat, id1, id2, id3, id4))
+	  tried_net = 1;
+	  if (name = pci_id_net_lookup(a, cat, id1, id2, id3, id4, &absent))
 	    {
 	      pci_id_insert(a, cat, id1, id2, id3, id4, name, SRC_NET);
+	      pci_id_cache_add(a, cat, id1, id2, id3, id4, name);
 	      pci_mfree(name);
-	      pci_id_cache_dirty(a);
+	      /* We want to iterate the lookup to get the allocated ID entry from the hash */
+	      continue;
+	    }
+	  /* Negative answers are cached, too, but not failures of the DNS itself */
+	  if (absent)
+	    {
+	      pci_id_set_absent(a, cat, id1, id2, id3, id4, SRC_NET);
+	      pci_id_cache_add(a, cat, id1, id2, id3, id4, NULL);
 	    }
-	  else
-	    pci_id_insert(a, cat, id1, id2, id3, id4, "", SRC_NET);
-	  /* We want to iterate the lookup to get the allocated ID entry from the hash */
-	  continue;
 	}
       return NULL;
     }
@@ -122,16 +138,9 @@ format_name_pair(char *buf, int size, int flags, char *v, char *d, char *num)
   return buf;
 }
 
-char *
-pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...)
+static int
+lookup_flags(struct pci_access *a, int flags)
 {
-  va_list args;
-  char *v, *d, *cls, *pif;
-  int iv, id, isv, isd, icls, ipif;
-  char numbuf[16], pifbuf[32];
-
-  va_start(args, flags);
-
   flags |= a->id_lookup_mode;
   if (!(flags & PCI_LOOKUP_NO_NUMBERS))
     {
@@ -145,6 +154,20 @@ pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...)
 
   if (!a->id_load_attempted && !(flags & (PCI_LOOKUP_NUMERIC | PCI_LOOKUP_SKIP_LOCAL)))
     pci_load_name_list(a);
+  return flags;
+}
+
+char *
+pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...)
+{
+  va_list args;
+  char *v, *d, *cls, *pif;
+  int iv, id, isv, isd, icls, ipif;
+  char numbuf[16], pifbuf[32];
+
+  va_start(args, flags);
+
+  flags = lookup_flags(a, flags);
 
   switch (flags & 0xffff)
     {
@@ -227,3 +250,196 @@ pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...)
       return "<pci_lookup_name: invalid request>";
     }
 }
+
+/*
+ *  Prefetching of names for a list of devices. Instead of asking the DNS
+ *  one ID at a time (and waiting for a round trip each time), we collect
+ *  all IDs which are not known locally and resolve them at once. Fallback
+ *  IDs (generic subsystems, classes of unknown subclasses) are asked in
+ *  a second round, only if they will be really needed.
+ */
+
+struct prefetch {
+  struct id_net_query *q;
+  int n, max;
+};
+
+static int
+prefetch_add(struct pci_access *a, struct prefetch *p, int flags, int cat, int id1, int id2, int id3, int id4)
+{
+  struct id_net_query *q;
+  int i;
+
+  /* Known already, possibly from a previous round of prefetching? */
+  if (pci_id_lookup(a, flags, cat, id1, id2, id3, id4) ||
+      id_lookup(a, flags & ~PCI_LOOKUP_NETWORK, cat, id1, id2, id3, id4))
+    return 1;
+  if (pci_id_absent(a, cat, id1, id2, id3, id4, SRC_NET))
+    return 0;
+  for (i=0; i < p->n; i++)
+    {
+      q = &p->q[i];
+      if (q->cat == cat && q->id1 == id1 && q->id2 == id2 && q->id3 == id3 && q->id4 == id4)
+	return 0;
+    }
+  if (p->n == p->max)
+    {
+      p->max = (p->max ? 2*p->max : 16);
+      p->q = pci_realloc(a, p->q, p->max * sizeof(struct id_net_query));
+    }
+  q = &p->q[p->n++];
+  q->cat = cat;
+  q->id1 = id1;
+  q->id2 = id2;
+  q->id3 = id3;
+  q->id4 = id4;
+  return 0;
+}
+
+static void
+prefetch_resolve(struct pci_access *a, struct prefetch *p)
+{
+  struct id_net_query *q;
+  int i;
+
+  if (!p->n)
+    return;
+  a->debug("Prefetching %d names from DNS\n", p->n);
+  pci_id_net_lookup_batch(a, p->q, p->n);
+  for (i=0; i < p->n; i++)
+    {
+      q = &p->q[i];
+      if (q->name)
+	{
+	  pci_id_insert(a, q->cat, q->id1, q->id2, q->id3, q->id4, q->name, SRC_NET);
+	  pci_id_cache_add(a, q->cat, q->id1, q->id2, q->id3, q->id4, q->name);
+	  pci_mfree(q->name);
+	}
+      else if (q->absent)
+	{
+	  pci_id_set_absent(a, q->cat, q->id1, q->id2, q->id3, q->id4, SRC_NET);
+	  pci_id_cache_add(a, q->cat, q->id1, q->id2, q->id3, q->id4, NULL);
+	}
+    }
+  p->n = 0;
+}
+
+/*
+ *  The hwdb is asked once per device: a single query returns names of the
+ *  vendor, the device, and all parts of the class. Results are remembered
+ *  in the hash (including failures), so later lookups do not query again.
+ */
+
+static int
+hwdb_wanted(struct pci_access *a, int flags, int cat, int id1, int id2, int id3)
+{
+  return !pci_id_lookup(a, flags, cat, id1, id2, id3, 0) &&
+    !id_lookup(a, (flags | PCI_LOOKUP_NO_HWDB) & ~PCI_LOOKUP_NETWORK, cat, id1, id2, id3, 0) &&
+    !pci_id_absent(a, cat, id1, id2, id3, 0, SRC_HWDB);
+}
+
+static void
+prefetch_hwdb(struct pci_access *a, int flags, struct pci_dev *d)
+{
+  int want[ID_PROGIF+1], ids[ID_PROGIF+1][3];
+  char *names[ID_PROGIF+1];
+  int cat, cls = -1, progif = -1, asked = 0;
+
+  if (!(d->known_fields & PCI_FILL_IDENT))
+    return;
+
+  memset(want, 0, sizeof(want));
+  memset(ids, 0, sizeof(ids));
+  ids[ID_VENDOR][0] = ids[ID_DEVICE][0] = d->vendor_id;
+  ids[ID_DEVICE][1] = d->device_id;
+  want[ID_VENDOR] = hwdb_wanted(a, flags, ID_VENDOR, d->vendor_id, 0, 0);
+  want[ID_DEVICE] = hwdb_wanted(a, flags, ID_DEVICE, d->vendor_id, d->device_id, 0);
+  if (d->known_fields & PCI_FILL_CLASS)
+    {
+      cls = d->device_class;
+      ids[ID_CLASS][0] = ids[ID_SUBCLASS][0] = ids[ID_PROGIF][0] = cls >> 8;
+      ids[ID_SUBCLASS][1] = ids[ID_PROGIF][1] = cls & 0xff;
+      want[ID_SUBCLASS] = hwdb_wanted(a, flags, ID_SUBCLASS, cls >> 8, cls & 0xff, 0);
+      want[ID_CLASS] = want[ID_SUBCLASS] && hwdb_wanted(a, flags, ID_CLASS, cls >> 8, 0, 0);
+      if (d->known_fields & PCI_FILL_CLASS_EXT)
+	{
+	  progif = ids[ID_PROGIF][2] = d->prog_if;
+	  want[ID_PROGIF] = hwdb_wanted(a, flags, ID_PROGIF, cls >> 8, cls & 0xff, progif);
+	}
+    }
+  if (!want[ID_VENDOR] && !want[ID_DEVICE] && !want[ID_SUBCLASS] && !want[ID_PROGIF])
+    return;
+
+  if (!pci_id_hwdb_lookup_device(a, d->vendor_id, d->device_id, cls, progif, names))
+    return;
+  if (names[ID_SUBCLASS])
+    want[ID_CLASS] = 0;		/* The class name will not be needed */
+
+  for (cat=ID_VENDOR; cat<=ID_PROGIF; cat++)
+    {
+      if (want[cat])
+	{
+	  asked++;
+	  if (names[cat])
+	    pci_id_insert(a, cat, ids[cat][0], ids[cat][1], ids[cat][2], 0, names[cat], SRC_HWDB);
+	  else
+	    pci_id_set_absent(a, cat, ids[cat][0], ids[cat][1], ids[cat][2], 0, SRC_HWDB);
+	}
+      pci_mfree(names[cat]);
+    }
+  if (asked > 1)
+    a->id_hwdb_saved += asked - 1;
+}
+
+void
+pci_lookup_prefetch(struct pci_access *a, int flags, struct pci_dev **devs, int n)
+{
+  struct prefetch p = { NULL, 0, 0 };
+  struct pci_dev *d;
+  int i, pass, known;
+
+  flags = lookup_flags(a, flags);
+  if (flags & PCI_LOOKUP_NUMERIC)
+    return;
+
+  if (!(flags & (PCI_LOOKUP_SKIP_LOCAL | PCI_LOOKUP_NO_HWDB)))
+    for (i=0; i<n; i++)
+      prefetch_hwdb(a, flags, devs[i]);
+
+  if (!(flags & PCI_LOOKUP_NETWORK))
+    return;
+
+  for (pass=0; pass<2; pass++)
+    {
+      for (i=0; i<n; i++)
+	{
+	  d = devs[i];
+	  if (d->known_fields & PCI_FILL_IDENT)
+	    {
+	      if (!pass)
+		{
+		  prefetch_add(a, &p, flags, ID_VENDOR, d->vendor_id, 0, 0, 0);
+		  prefetch_add(a, &p, flags, ID_DEVICE, d->vendor_id, d->device_id, 0, 0);
+		}
+	      if ((d->known_fields & PCI_FILL_SUBSYS) && d->subsys_vendor_id && d->subsys_vendor_id != 0xffff)
+		{
+		  known = prefetch_add(a, &p, flags, ID_SUBSYSTEM, d->vendor_id, d->device_id, d->subsys_vendor_id, d->subsys_id);
+		  if (!pass)
+		    prefetch_add(a, &p, flags, ID_VENDOR, d->subsys_vendor_id, 0, 0, 0);
+		  else if (!known)
+		    prefetch_add(a, &p, flags, ID_GEN_SUBSYSTEM, d->subsys_vendor_id, d->subsys_id, 0, 0);
+		}
+	    }
+	  if (d->known_fields & PCI_FILL_CLASS)
+	    {
+	      known = prefetch_add(a, &p, flags, ID_SUBCLASS, d->device_class >> 8, d->device_class & 0xff, 0, 0);
+	      if (pass && !known)
+		prefetch_add(a, &p, flags, ID_CLASS, d->device_class >> 8, 0, 0, 0);
+	      if (!pass && (d->known_fields & PCI_FILL_CLASS_EXT))
+		prefetch_add(a, &p, flags, ID_PROGIF, d->device_class >> 8, d->device_class & 0xff, d->prog_if, 0);
+	    }
+	}
+      prefetch_resolve(a, &p);
+    }
+  pci_mfree(p.q);
+}
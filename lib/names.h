@@ -17,6 +17,7 @@ struct id_entry {
   u32 id12, id34;
   byte cat;
   byte src;
+  byte absent;				/* SRC_ABSENT: mask of sources known not to have the ID */
   char name[1];
 };
 
@@ -37,6 +38,7 @@ enum id_entry_src {
   SRC_NET,
   SRC_HWDB,
   SRC_LOCAL,
+  SRC_ABSENT,				/* Not a name, only records failed lookups */
 };
 
 #define BUCKET_SIZE 8192
@@ -59,19 +61,58 @@ static inline unsigned int pair_second(unsigned int x)
 
 int pci_id_insert(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *text, enum id_entry_src src);
 char *pci_id_lookup(struct pci_access *a, int flags, int cat, int id1, int id2, int id3, int id4);
+int pci_id_absent(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, enum id_entry_src src);
+void pci_id_set_absent(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, enum id_entry_src src);
+
+struct id_arena_item {
+  struct id_arena_item *next;
+  int lino;				/* Where the entry was defined */
+  struct id_entry e;
+};
+
+struct id_arena {
+  struct id_bucket *buckets;
+  struct id_arena_item *first, **last;	/* In order of addition */
+};
+
+void pci_id_arena_init(struct id_arena *ar);
+void pci_id_arena_add(struct pci_access *a, struct id_arena *ar, int lino, int cat, int id1, int id2, int id3, int id4, char *text);
+int pci_id_link(struct pci_access *a, struct id_entry *e);
+void pci_id_arena_adopt(struct pci_access *a, struct id_arena *ar);
+
+/* names-parse.c */
+
+void pci_id_lazy_load(struct pci_access *a, int cat, int id1);
+
+/* names-bin.c */
+
+int pci_id_bin_load(struct pci_access *a);
+void pci_id_bin_build(struct pci_access *a);
+void pci_id_bin_save(struct pci_access *a);
+char *pci_id_bin_lookup(struct pci_access *a, int cat, u32 id12, u32 id34);
+void pci_id_bin_free(struct pci_access *a);
 
 /* names-cache.c */
 
 int pci_id_cache_load(struct pci_access *a, int flags);
-void pci_id_cache_dirty(struct pci_access *a);
+char *pci_id_cache_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, int *absent);
+void pci_id_cache_add(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, char *name);
 void pci_id_cache_flush(struct pci_access *a);
 void pci_id_hash_free(struct pci_access *a);
 
-/* names-dns.c */
+/* names-net.c */
+
+struct id_net_query {
+  int cat, id1, id2, id3, id4;
+  char *name;				/* Result (allocated by malloc) or NULL */
+  int absent;				/* The server does not know the ID */
+};
 
-char *pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4);
+char *pci_id_net_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4, int *absent);
+void pci_id_net_lookup_batch(struct pci_access *a, struct id_net_query *q, int n);
 
 /* names-hwdb.c */
 
 char *pci_id_hwdb_lookup(struct pci_access *a, int cat, int id1, int id2, int id3, int id4);
+int pci_id_hwdb_lookup_device(struct pci_access *a, int vendor, int device, int cls, int progif, char **names);
 void pci_id_hwdb_free(struct pci_access *a);
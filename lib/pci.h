@@ -84,15 +84,22 @@ struct pci_access {
   struct pci_param *params;
   struct id_entry **id_hash;		/* names.c */
   struct id_bucket *current_id_bucket;
+  struct id_bin *id_bin;		/* names-bin.c: compiled ID database */
+  struct id_lazy *id_lazy;		/* names-parse.c: index for lazy loading */
   int id_load_attempted;
   int id_cache_status;			/* 0=not read, 1=read, 2=dirty */
+  struct id_cache *id_cache;		/* names-cache.c */
+  int id_net_failed;			/* names-net.c: DNS does not work, do not try again */
   char *id_cache_name;
   struct udev *id_udev;			/* names-hwdb.c */
   struct udev_hwdb *id_udev_hwdb;
-  int fd;				/* proc/sys: fd for config space */
-  int fd_rw;				/* proc/sys: fd opened read-write */
-  int fd_vpd;				/* sys: fd for VPD */
-  struct pci_dev *cached_dev;		/* proc/sys: device the fds are for */
+  unsigned int id_hwdb_queries;		/* names-hwdb.c: statistics */
+  unsigned int id_hwdb_saved;
+  int fd;				/* proc: fd for config space */
+  int fd_rw;				/* proc: fd opened read-write */
+  struct pci_dev *cached_dev;		/* proc: device the fd is for */
+  unsigned int fd_cache_hits;		/* sys: config/VPD fd cache statistics */
+  unsigned int fd_cache_misses;
   void *backend_data;			/* Private data of the back end */
 };
 
@@ -107,6 +114,31 @@ void pci_scan_bus(struct pci_access *acc) PCI_ABI;
 struct pci_dev *pci_get_dev(struct pci_access *acc, int domain, int bus, int dev, int func) PCI_ABI; /* Raw access to specified device */
 void pci_free_dev(struct pci_dev *) PCI_ABI;
 
+/*
+ * Incremental updates of the list of devices after hot-plug events.
+ *
+ * pci_hotplug_open() starts listening to hot-plug events and returns a file
+ * descriptor which becomes readable when events are pending, or -1 if the
+ * back-end does not support them. Call it before pci_scan_bus(), so that no
+ * events are missed.
+ *
+ * pci_rescan_incremental() processes the pending events: it adds devices
+ * which appeared to the list, removes devices which disappeared (and frees
+ * them, so pointers to them become invalid) and forgets the cached
+ * properties of devices which changed (for example, a driver was bound).
+ * If pci_hotplug_open() was not called or events were lost, the list is
+ * compared with the current state of the system instead. Returns the number
+ * of devices affected or -1 if not supported by the back-end.
+ *
+ * pci_hotplug_event() processes a single event given in the format of
+ * Linux kernel uevents ("ACTION@DEVPATH", then "KEY=VALUE" strings, all
+ * terminated by NUL characters), which is useful for testing. Returns the
+ * number of devices affected or -1 if not supported.
+ */
+int pci_hotplug_open(struct pci_access *acc) PCI_ABI;
+int pci_rescan_incremental(struct pci_access *acc) PCI_ABI;
+int pci_hotplug_event(struct pci_access *acc, const char *msg, int len) PCI_ABI;
+
 /* Names of access methods */
 int pci_lookup_method(char *name) PCI_ABI;	/* Returns -1 if not found */
 char *pci_get_method_name(int index) PCI_ABI;	/* Returns "" if unavailable, NULL if index out of range */
@@ -195,6 +227,24 @@ int pci_write_long(struct pci_dev *, int pos, u32 data) PCI_ABI;
 int pci_read_block(struct pci_dev *, int pos, u8 *buf, int len) PCI_ABI;
 int pci_write_block(struct pci_dev *, int pos, u8 *buf, int len) PCI_ABI;
 
+/*
+ * Read blocks of configuration space of possibly many devices at once.
+ * Back-ends which can do so issue the reads concurrently, the others
+ * just call pci_read_block() for each request. Data present in the caches
+ * set up by pci_setup_cache() are taken from there. The status of each
+ * request is set to 1 on success or 0 on failure; the number of successful
+ * requests is returned.
+ */
+struct pci_read_request {
+  struct pci_dev *dev;
+  int pos;
+  u8 *buf;
+  int len;
+  int status;
+};
+
+int pci_read_blocks(struct pci_access *a, struct pci_read_request *req, int n) PCI_ABI;
+
 /*
  * Most device properties take some effort to obtain, so libpci does not
  * initialize them during default bus scan. Instead, you have to call
@@ -217,6 +267,15 @@ int pci_write_block(struct pci_dev *, int pos, u8 *buf, int len) PCI_ABI;
 int pci_fill_info(struct pci_dev *, int flags) PCI_ABI;
 char *pci_get_string_property(struct pci_dev *d, u32 prop) PCI_ABI;
 
+/*
+ * Call pci_fill_info() with the same flags for many devices. Back-ends
+ * which support it can process the devices in parallel (see the sysfs.threads
+ * parameter); warnings are still reported in the order of devices.
+ * Like with pci_fill_info(), fields which could not be filled are tried
+ * again by subsequent pci_fill_info() calls.
+ */
+void pci_prefetch_info(struct pci_access *a, struct pci_dev **devs, int n, int flags) PCI_ABI;
+
 #define PCI_FILL_IDENT		0x0001		/* vendor and device ID */
 #define PCI_FILL_IRQ		0x0002
 #define PCI_FILL_BASES		0x0004
@@ -296,6 +355,17 @@ int pci_filter_match(struct pci_filter *, struct pci_dev *) PCI_ABI;
 
 char *pci_lookup_name(struct pci_access *a, char *buf, int size, int flags, ...) PCI_ABI;
 
+/*
+ *	If names are going to be looked up for many devices, pci_lookup_prefetch()
+ *	can resolve all their ID's in advance: it asks udev's hwdb once per device
+ *	and sends the DNS queries (if PCI_LOOKUP_NETWORK is in effect) in parallel.
+ *	It uses the fields of the devices already obtained by pci_fill_info()
+ *	(IDENT, CLASS, CLASS_EXT and SUBSYS). The flags have the same meaning
+ *	as for pci_lookup_name().
+ */
+
+void pci_lookup_prefetch(struct pci_access *a, int flags, struct pci_dev **devs, int n) PCI_ABI;
+
 int pci_load_name_list(struct pci_access *a) PCI_ABI;	/* Called automatically by pci_lookup_*() when needed; returns success */
 void pci_free_name_list(struct pci_access *a) PCI_ABI;	/* Called automatically by pci_cleanup() */
 void pci_set_name_list_path(struct pci_access *a, char *name, int to_be_freed) PCI_ABI;
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -31,6 +32,8 @@
 
 struct physmem {
   int fd;
+  int is_file;			/* A regular file with an image of physical memory */
+  u64 size;			/* ... and its size */
 };
 
 void
@@ -52,6 +55,7 @@ physmem_open(struct pci_access *a, int w)
 {
   const char *devmem = pci_get_param(a, "devmem.path");
   struct physmem *physmem = pci_malloc(a, sizeof(struct physmem));
+  struct stat st;
 
   a->debug("trying to open physical memory device %s in %s mode...", devmem, w ? "read/write" : "read-only");
   physmem->fd = open(devmem, (w ? O_RDWR : O_RDONLY) | O_DSYNC); /* O_DSYNC bypass CPU cache for mmap() on Linux */
@@ -61,6 +65,23 @@ physmem_open(struct pci_access *a, int w)
       return NULL;
     }
 
+  /*
+   * A regular file can stand in for physical memory (e.g., a synthetic ECAM
+   * image generated by maint/gen-ecam-image). Accessing a mapping beyond its
+   * end would raise SIGBUS, so we refuse to map such ranges.
+   */
+  if (fstat(physmem->fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+      a->debug("using regular file of size %llu as physical memory...", (unsigned long long) st.st_size);
+      physmem->is_file = 1;
+      physmem->size = st.st_size;
+    }
+  else
+    {
+      physmem->is_file = 0;
+      physmem->size = 0;
+    }
+
   return physmem;
 }
 
@@ -85,6 +106,11 @@ physmem_map(struct physmem *physmem, u64 addr, size_t length, int w)
       errno = EOVERFLOW;
       return (void *)-1;
     }
+  if (physmem->is_file && (addr > physmem->size || length > physmem->size - addr))
+    {
+      errno = ENXIO;
+      return (void *)-1;
+    }
   return mmap(NULL, length, PROT_READ | (w ? PROT_WRITE : 0), MAP_SHARED, physmem->fd, addr);
 }
 
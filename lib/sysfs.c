@@ -19,15 +19,36 @@
 #include <errno.h>
 #include <dirent.h>
 #include <fcntl.h>
-#include <libgen.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #include "internal.h"
 
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#ifdef PCI_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 static void
 sysfs_config(struct pci_access *a)
 {
   pci_define_param(a, "sysfs.path", PCI_PATH_SYS_BUS_PCI, "Path to the sysfs device tree");
+  pci_define_param(a, "sysfs.fd_cache", "16", "Number of devices to keep config space files open for");
+  pci_define_param(a, "sysfs.vpd_cache", "1", "Read VPD a resource at a time and keep it in memory if non-zero");
+  pci_define_param(a, "sysfs.vpd_cache_dir", "", "Directory for caching VPD across runs (empty=disabled)");
+#ifdef PCI_HAVE_PTHREADS
+  pci_define_param(a, "sysfs.threads", "1", "Number of threads used by pci_prefetch_info() (0=one per CPU)");
+#endif
+#ifdef PCI_HAVE_IO_URING
+  pci_define_param(a, "sysfs.io_uring", "1", "Use io_uring for batched reads of config space if non-zero");
+#endif
 }
 
 static inline char *
@@ -48,33 +69,161 @@ sysfs_detect(struct pci_access *a)
   return 1;
 }
 
+/*
+ *  Each device keeps an O_PATH descriptor of its sysfs directory, so that
+ *  its attributes can be reached by openat() and readlinkat() without
+ *  formatting full path names and making the kernel walk them each time.
+ *  If the descriptor cannot be opened (e.g., we ran out of descriptors),
+ *  we fall back to full paths.
+ *
+ *  Config space and VPD files are kept open for the sysfs.fd_cache most
+ *  recently accessed devices, so that callers alternating between devices
+ *  do not pay for an open/close pair per access.
+ */
+
+struct sysfs_access {
+  int devices_fd;			/* Directory with all devices, -1 if not open */
+  struct sysfs_dev *lru_first;		/* Devices with open config/VPD fds, most recently used first */
+  struct sysfs_dev *lru_last;
+  int lru_count, lru_max;
+  struct pci_dev **index;		/* Hash of all devices by their address, NULL if not built */
+  int index_size;
+  int uevent_fd;			/* Netlink socket for hot-plug events, -1 if not open */
+  int vpd_cache;			/* Value of sysfs.vpd_cache */
+  char *boot_id;			/* Boot ID for the on-disk VPD cache, NULL if not known yet */
+#ifdef PCI_HAVE_IO_URING
+  struct sysfs_uring *uring;		/* NULL if not set up yet or not available */
+  int uring_failed;
+#endif
+#ifdef PCI_HAVE_PTHREADS
+  int threaded;				/* pci_prefetch_info() runs in multiple threads */
+  pthread_mutex_t lock;			/* ... and then this protects the fd cache */
+#endif
+};
+
+struct sysfs_dev {
+  int dir_fd;				/* Directory of the device, -1 if not available, -2 if not tried yet */
+  int fd;				/* Config space, -1 if not open */
+  int fd_rw;				/* ... opened read-write */
+  int fd_vpd;				/* VPD, -1 if not open */
+  int users;				/* Number of threads doing I/O on the fds, which must not be closed */
+  struct sysfs_dev *lru_prev, *lru_next;
+  char *canon_path;			/* Canonical path of the device directory (malloc'ed), NULL if unknown */
+  int canon_tried;
+  byte *vpd;				/* Cached VPD (malloc'ed) */
+  int vpd_len;				/* ... its length, -1 if not loaded yet, -2 if it cannot be cached */
+  int vpd_alloc;			/* ... allocated size */
+  int vpd_next;				/* ... offset of the first resource not cached yet */
+  int vpd_complete;			/* ... all VPD is cached */
+};
+
 static void
 sysfs_init(struct pci_access *a)
 {
-  a->fd = -1;
-  a->fd_vpd = -1;
+  struct sysfs_access *sa = pci_malloc(a, sizeof(struct sysfs_access));
+  char *param = pci_get_param(a, "sysfs.fd_cache");
+  char *end;
+
+  sa->devices_fd = -1;
+  sa->lru_first = sa->lru_last = NULL;
+  sa->lru_count = 0;
+  sa->index = NULL;
+  sa->index_size = 0;
+  sa->uevent_fd = -1;
+  sa->vpd_cache = atoi(pci_get_param(a, "sysfs.vpd_cache"));
+  sa->boot_id = NULL;
+  sa->lru_max = strtol(param, &end, 10);
+  if (*end || sa->lru_max < 1)
+    {
+      a->warning("Invalid sysfs.fd_cache value %s, using 1", param);
+      sa->lru_max = 1;
+    }
+#ifdef PCI_HAVE_IO_URING
+  sa->uring = NULL;
+  sa->uring_failed = !atoi(pci_get_param(a, "sysfs.io_uring"));
+#endif
+#ifdef PCI_HAVE_PTHREADS
+  sa->threaded = 0;
+  pthread_mutex_init(&sa->lock, NULL);
+#endif
+  a->backend_data = sa;
+}
+
+static void
+sysfs_lru_unlink(struct sysfs_access *sa, struct sysfs_dev *sd)
+{
+  if (sd->lru_prev)
+    sd->lru_prev->lru_next = sd->lru_next;
+  else
+    sa->lru_first = sd->lru_next;
+  if (sd->lru_next)
+    sd->lru_next->lru_prev = sd->lru_prev;
+  else
+    sa->lru_last = sd->lru_prev;
+  sd->lru_prev = sd->lru_next = NULL;
+  sa->lru_count--;
+}
+
+static void
+sysfs_lru_insert(struct sysfs_access *sa, struct sysfs_dev *sd)
+{
+  sd->lru_prev = NULL;
+  sd->lru_next = sa->lru_first;
+  if (sa->lru_first)
+    sa->lru_first->lru_prev = sd;
+  else
+    sa->lru_last = sd;
+  sa->lru_first = sd;
+  sa->lru_count++;
+}
+
+static inline int
+sysfs_lru_member(struct sysfs_dev *sd)
+{
+  return sd->fd >= 0 || sd->fd_vpd >= 0;
 }
 
 static void
-sysfs_flush_cache(struct pci_access *a)
+sysfs_close_fds(struct sysfs_access *sa, struct sysfs_dev *sd)
 {
-  if (a->fd >= 0)
+  if (!sysfs_lru_member(sd))
+    return;
+  sysfs_lru_unlink(sa, sd);
+  if (sd->fd >= 0)
     {
-      close(a->fd);
-      a->fd = -1;
+      close(sd->fd);
+      sd->fd = -1;
     }
-  if (a->fd_vpd >= 0)
+  if (sd->fd_vpd >= 0)
     {
-      close(a->fd_vpd);
-      a->fd_vpd = -1;
+      close(sd->fd_vpd);
+      sd->fd_vpd = -1;
     }
-  a->cached_dev = NULL;
 }
 
+static void sysfs_uring_close(struct sysfs_access *sa);
+
 static void
 sysfs_cleanup(struct pci_access *a)
 {
-  sysfs_flush_cache(a);
+  struct sysfs_access *sa = a->backend_data;
+
+  while (sa->lru_first)
+    sysfs_close_fds(sa, sa->lru_first);
+  if (a->fd_cache_hits || a->fd_cache_misses)
+    a->debug("sysfs: fd cache: %u hits, %u misses\n", a->fd_cache_hits, a->fd_cache_misses);
+  if (sa->devices_fd >= 0)
+    close(sa->devices_fd);
+  if (sa->uevent_fd >= 0)
+    close(sa->uevent_fd);
+  sysfs_uring_close(sa);
+  pci_mfree(sa->index);
+  free(sa->boot_id);
+#ifdef PCI_HAVE_PTHREADS
+  pthread_mutex_destroy(&sa->lock);
+#endif
+  pci_mfree(sa);
+  a->backend_data = NULL;
 }
 
 #define OBJNAMELEN 1024
@@ -87,22 +236,106 @@ sysfs_obj_name(struct pci_dev *d, char *object, char *buf)
     d->access->error("File name too long");
 }
 
+static struct sysfs_dev *
+sysfs_dev_data(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = d->backend_data;
+
+  if (!sd)
+    {
+      sd = pci_malloc(d->access, sizeof(struct sysfs_dev));
+      sd->dir_fd = -2;
+      sd->fd = sd->fd_vpd = -1;
+      sd->fd_rw = 0;
+      sd->users = 0;
+      sd->lru_prev = sd->lru_next = NULL;
+      sd->canon_path = NULL;
+      sd->canon_tried = 0;
+      sd->vpd = NULL;
+      sd->vpd_len = -1;
+      sd->vpd_alloc = sd->vpd_next = sd->vpd_complete = 0;
+      d->backend_data = sd;
+    }
+  return sd;
+}
+
+static int
+sysfs_dev_dir(struct pci_dev *d)
+{
+  struct pci_access *a = d->access;
+  struct sysfs_access *sa = a->backend_data;
+  struct sysfs_dev *sd = sysfs_dev_data(d);
+  char name[OBJNAMELEN];
+
+  if (sd->dir_fd == -2)
+    {
+      sd->dir_fd = -1;
+      if (sa->devices_fd < 0)
+	{
+	  snprintf(name, sizeof(name), "%s/devices", sysfs_name(a));
+	  sa->devices_fd = open(name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	}
+      if (sa->devices_fd >= 0)
+	{
+	  sprintf(name, "%04x:%02x:%02x.%d", d->domain, d->bus, d->dev, d->func);
+	  sd->dir_fd = openat(sa->devices_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	}
+    }
+  return sd->dir_fd;
+}
+
+/* Open an object in the device directory, relative to its descriptor if possible */
+static int
+sysfs_open_obj(struct pci_dev *d, char *object, int flags)
+{
+  char namebuf[OBJNAMELEN];
+  int dir = sysfs_dev_dir(d);
+
+  if (dir >= 0)
+    return openat(dir, object, flags);
+  sysfs_obj_name(d, object, namebuf);
+  return open(namebuf, flags);
+}
+
+static int
+sysfs_read_link(struct pci_dev *d, char *link_name, char *buf, int size)
+{
+  char namebuf[OBJNAMELEN];
+  int dir = sysfs_dev_dir(d);
+  int n;
+
+  if (dir >= 0)
+    n = readlinkat(dir, link_name, buf, size - 1);
+  else
+    {
+      sysfs_obj_name(d, link_name, namebuf);
+      n = readlink(namebuf, buf, size - 1);
+    }
+  if (n < 0)
+    return 0;
+  buf[n] = 0;
+  return 1;
+}
+
 #define OBJBUFSIZE 1024
 
 static int
 sysfs_get_string(struct pci_dev *d, char *object, char *buf, int mandatory)
 {
   struct pci_access *a = d->access;
-  int fd, n;
+  int fd, n, err;
   char namebuf[OBJNAMELEN];
   void (*warn)(char *msg, ...) = (mandatory ? a->error : a->warning);
 
-  sysfs_obj_name(d, object, namebuf);
-  fd = open(namebuf, O_RDONLY);
+  fd = sysfs_open_obj(d, object, O_RDONLY);
   if (fd < 0)
     {
-      if (mandatory || errno != ENOENT)
-	warn("Cannot open %s: %s", namebuf, strerror(errno));
+      err = errno;
+      if (mandatory || err != ENOENT)
+	{
+	  sysfs_obj_name(d, object, namebuf);
+	  warn("Cannot open %s: %s", namebuf, strerror(err));
+	}
       return 0;
     }
   n = read(fd, buf, OBJBUFSIZE);
@@ -110,11 +343,13 @@ sysfs_get_string(struct pci_dev *d, char *object, char *buf, int mandatory)
   close(fd);
   if (n < 0)
     {
+      sysfs_obj_name(d, object, namebuf);
       warn("Error reading %s: %s", namebuf, strerror(read_errno));
       return 0;
     }
   if (n >= OBJBUFSIZE)
     {
+      sysfs_obj_name(d, object, namebuf);
       warn("Value in %s too long", namebuf);
       return 0;
     }
@@ -122,15 +357,24 @@ sysfs_get_string(struct pci_dev *d, char *object, char *buf, int mandatory)
   return 1;
 }
 
+/* Return the last component of the target of a symlink */
+static char *
+sysfs_link_basename(struct pci_dev *d, char *link_name, char *buf, int size)
+{
+  char *p;
+
+  if (!sysfs_read_link(d, link_name, buf, size))
+    return NULL;
+  p = strrchr(buf, '/');
+  return p ? p+1 : buf;
+}
+
 static char *
 sysfs_deref_link(struct pci_dev *d, char *link_name)
 {
   char path[2*OBJNAMELEN], rel_path[OBJNAMELEN];
 
-  sysfs_obj_name(d, link_name, path);
-  memset(rel_path, 0, sizeof(rel_path));
-
-  if (readlink(path, rel_path, sizeof(rel_path)) < 0)
+  if (!sysfs_read_link(d, link_name, rel_path, sizeof(rel_path)))
     return NULL;
 
   sysfs_obj_name(d, "", path);
@@ -151,28 +395,239 @@ sysfs_get_value(struct pci_dev *d, char *object, int mandatory)
     return -1;
 }
 
+/*
+ *  The uevent attribute carries the IDs, class, module alias and driver
+ *  in a single file, so we read it at most once per fill_info call
+ *  instead of opening each of the individual attributes.
+ */
+struct sysfs_uevent {
+  int state;				/* 0=not read yet, 1=valid, -1=unavailable */
+  int len;
+  char buf[OBJBUFSIZE];
+};
+
+static char *
+sysfs_uevent_get(struct pci_dev *d, struct sysfs_uevent *ue, char *key)
+{
+  int klen = strlen(key);
+  char *p, *end;
+
+  if (!ue->state)
+    {
+      ue->state = -1;
+      if (sysfs_get_string(d, "uevent", ue->buf, 0))
+	{
+	  ue->len = strlen(ue->buf);
+	  for (p = ue->buf; p < ue->buf + ue->len; p++)
+	    if (*p == '\n')
+	      *p = 0;
+	  ue->state = 1;
+	}
+    }
+  if (ue->state < 0)
+    return NULL;
+
+  end = ue->buf + ue->len;
+  for (p = ue->buf; p < end; p += strlen(p) + 1)
+    if (!strncmp(p, key, klen) && p[klen] == '=')
+      return p + klen + 1;
+  return NULL;
+}
+
+/*
+ *  Parent devices are found by the canonical path of the device directory:
+ *  its parent directory is named after the address of the parent device,
+ *  which we look up in a hash of all devices and verify that its canonical
+ *  path matches. Canonical paths are computed once per device and the hash
+ *  is built once per scan (or per hot-plug event adding or removing devices),
+ *  so linking all devices to their parents takes linear time.
+ */
+
+static char *
+sysfs_canon_path(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = sysfs_dev_data(d);
+  char path[OBJNAMELEN];
+
+  if (!sd->canon_tried)
+    {
+      sd->canon_tried = 1;
+      sysfs_obj_name(d, ".", path);
+      sd->canon_path = realpath(path, NULL);
+    }
+  return sd->canon_path;
+}
+
+static inline unsigned int
+sysfs_index_hash(int domain, int bus, int dev, int func)
+{
+  unsigned int h = ((unsigned int) domain << 16) ^ (bus << 8) ^ (dev << 3) ^ func;
+  return h * 0x9e3779b1;
+}
+
+static unsigned int
+sysfs_index_find(struct sysfs_access *sa, unsigned int domain, unsigned int bus, unsigned int dev, unsigned int func)
+{
+  unsigned int i = sysfs_index_hash(domain, bus, dev, func) & (sa->index_size - 1);
+  struct pci_dev *p;
+
+  while ((p = sa->index[i]) &&
+	 !(p->domain == (int)domain && p->bus == bus && p->dev == dev && p->func == func))
+    i = (i + 1) & (sa->index_size - 1);
+  return i;
+}
+
+static void
+sysfs_build_index(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+  struct pci_dev *d;
+  unsigned int i, n = 0;
+
+  for (d = a->devices; d; d = d->next)
+    n++;
+  sa->index_size = 64;
+  while ((unsigned int) sa->index_size < 2*n)
+    sa->index_size *= 2;
+  sa->index = pci_malloc(a, sa->index_size * sizeof(struct pci_dev *));
+  memset(sa->index, 0, sa->index_size * sizeof(struct pci_dev *));
+
+  for (d = a->devices; d; d = d->next)
+    {
+      i = sysfs_index_hash(d->domain, d->bus, d->dev, d->func) & (sa->index_size - 1);
+      while (sa->index[i])
+	i = (i + 1) & (sa->index_size - 1);
+      sa->index[i] = d;
+    }
+}
+
+static void
+sysfs_drop_index(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+
+  pci_mfree(sa->index);
+  sa->index = NULL;
+}
+
+static struct pci_dev *
+sysfs_find_parent(struct pci_dev *d)
+{
+  struct pci_access *a = d->access;
+  struct sysfs_access *sa = a->backend_data;
+  unsigned int domain, bus, dev, func;
+  char *path, *name, *parent_path;
+  struct pci_dev *p;
+  int len;
+
+  if (!sa->index)
+    sysfs_build_index(a);
+
+  /* The last component of the parent directory is the address of the parent device */
+  path = sysfs_canon_path(d);
+  name = path ? strrchr(path, '/') : NULL;
+  if (!name || name == path)
+    return NULL;
+  len = name - path;
+  for (name--; name > path && name[-1] != '/'; name--)
+    ;
+  if (sscanf(name, "%x:%x:%x.%d", &domain, &bus, &dev, &func) != 4 || domain > 0x7fffffff)
+    return NULL;
+
+  p = sa->index[sysfs_index_find(sa, domain, bus, dev, func)];
+  if (!p)
+    {
+      /* The device could have been added after the index was built */
+      for (p = a->devices; p; p = p->next)
+	if (p->domain == (int)domain && p->bus == bus && p->dev == dev && p->func == func)
+	  break;
+      if (!p)
+	return NULL;
+    }
+
+  /* Check that it is really the expected PCI device */
+  parent_path = sysfs_canon_path(p);
+  if (!parent_path || (int) strlen(parent_path) != len || memcmp(parent_path, path, len))
+    return NULL;
+  return p;
+}
+
+static inline int
+sysfs_hex_digit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/*
+ *  Parse a hexadecimal number in the same way as sscanf("%llx") does,
+ *  except that we do not skip newlines. Returns a pointer after the number,
+ *  or NULL if there is none.
+ */
+static char *
+sysfs_parse_hex(char *p, unsigned long long *val)
+{
+  unsigned long long x = 0;
+  int c;
+
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')
+    p++;
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && sysfs_hex_digit(p[2]) >= 0)
+    p += 2;
+  if (sysfs_hex_digit(*p) < 0)
+    return NULL;
+  while ((c = sysfs_hex_digit(*p)) >= 0)
+    {
+      x = (x << 4) | c;
+      p++;
+    }
+  *val = x;
+  return p;
+}
+
 static void
 sysfs_get_resources(struct pci_dev *d)
 {
   struct pci_access *a = d->access;
-  char namebuf[OBJNAMELEN], buf[256];
+  char namebuf[OBJNAMELEN], buf[4096];
   struct { pciaddr_t flags, base_addr, size; } lines[10];
   int have_bar_bases, have_rom_base, have_bridge_bases;
-  FILE *file;
-  int i;
+  char *p, *q, *buf_end;
+  int i, fd, n, len;
 
   have_bar_bases = have_rom_base = have_bridge_bases = 0;
-  sysfs_obj_name(d, "resource", namebuf);
-  file = fopen(namebuf, "r");
-  if (!file)
-    a->error("Cannot open %s: %s", namebuf, strerror(errno));
-  for (i = 0; i < 7+6+4+1; i++)
+  fd = sysfs_open_obj(d, "resource", O_RDONLY);
+  if (fd < 0)
+    {
+      int err = errno;
+      sysfs_obj_name(d, "resource", namebuf);
+      a->error("Cannot open %s: %s", namebuf, strerror(err));
+    }
+  /* Only the first 18 lines are interesting and they always fit in the buffer */
+  len = 0;
+  while (len < (int) sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+    len += n;
+  close(fd);
+  buf[len] = 0;
+  buf_end = buf + len;
+
+  p = buf;
+  for (i = 0; i < 7+6+4+1 && p < buf_end; i++)
     {
       unsigned long long start, end, size, flags;
-      if (!fgets(buf, sizeof(buf), file))
-	break;
-      if (sscanf(buf, "%llx %llx %llx", &start, &end, &flags) != 3)
-	a->error("Syntax error in %s", namebuf);
+      if (!(q = sysfs_parse_hex(p, &start)) ||
+	  !(q = sysfs_parse_hex(q, &end)) ||
+	  !(q = sysfs_parse_hex(q, &flags)))
+	{
+	  sysfs_obj_name(d, "resource", namebuf);
+	  a->error("Syntax error in %s", namebuf);
+	}
+      p = memchr(q, '\n', buf_end - q);
+      p = p ? p+1 : buf_end;
       if (end > start)
 	size = end - start + 1;
       else
@@ -225,7 +680,6 @@ sysfs_get_resources(struct pci_dev *d)
         }
       have_bridge_bases = 1;
     }
-  fclose(file);
   if (!have_bar_bases)
     clear_fill(d, PCI_FILL_BASES | PCI_FILL_SIZES | PCI_FILL_IO_FLAGS);
   if (!have_rom_base)
@@ -273,12 +727,37 @@ static void sysfs_scan(struct pci_access *a)
   closedir(dir);
 }
 
+/*
+ *  Physical slots are read in a single pass over the slots directory to
+ *  a hash indexed by the address of the slot. Then we look up each device
+ *  there, so the cost is linear in the number of slots and devices.
+ */
+
+struct sysfs_slot {
+  int used;
+  unsigned int domain, bus, dev;
+  char *name;
+};
+
+static struct sysfs_slot *
+sysfs_find_slot(struct sysfs_slot *hash, unsigned int size, unsigned int domain, unsigned int bus, unsigned int dev)
+{
+  unsigned int i = sysfs_index_hash(domain, bus, dev, 0) & (size - 1);
+
+  while (hash[i].used && !(hash[i].domain == domain && hash[i].bus == bus && hash[i].dev == dev))
+    i = (i + 1) & (size - 1);
+  return &hash[i];
+}
+
 static void
 sysfs_fill_slots(struct pci_access *a)
 {
   char dirname[1024];
   DIR *dir;
   struct dirent *entry;
+  struct sysfs_slot *hash, *s;
+  struct pci_dev *d;
+  unsigned int size, count, i;
   int n;
 
   n = snprintf(dirname, sizeof(dirname), "%s/slots", sysfs_name(a));
@@ -288,31 +767,37 @@ sysfs_fill_slots(struct pci_access *a)
   if (!dir)
     return;
 
+  size = 64;
+  count = 0;
+  hash = pci_malloc(a, size * sizeof(struct sysfs_slot));
+  memset(hash, 0, size * sizeof(struct sysfs_slot));
+
   while (entry = readdir(dir))
     {
       char namebuf[OBJNAMELEN], buf[16];
-      FILE *file;
       unsigned int dom, bus, dev;
-      int res = 0;
-      struct pci_dev *d;
+      int fd, res = 0;
 
       /* ".", ".." or a special non-device perhaps */
       if (entry->d_name[0] == '.')
 	continue;
 
-      n = snprintf(namebuf, OBJNAMELEN, "%s/%s/%s", dirname, entry->d_name, "address");
+      n = snprintf(namebuf, OBJNAMELEN, "%s/%s", entry->d_name, "address");
       if (n < 0 || n >= OBJNAMELEN)
 	a->error("File name too long");
-      file = fopen(namebuf, "r");
+      fd = openat(dirfd(dir), namebuf, O_RDONLY);
       /*
        * Old versions of Linux had a fakephp which didn't have an 'address'
        * file.  There's no useful information to be gleaned from these
        * devices, pretend they're not there.
        */
-      if (!file)
+      if (fd < 0)
 	continue;
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      buf[n > 0 ? n : 0] = 0;
 
-      if (!fgets(buf, sizeof(buf), file) || (res = sscanf(buf, "%x:%x:%x", &dom, &bus, &dev)) < 3)
+      if (n <= 0 || (res = sscanf(buf, "%x:%x:%x", &dom, &bus, &dev)) < 3)
 	{
 	  /*
 	   * In some cases, the slot is not tied to a specific device before
@@ -321,21 +806,56 @@ sysfs_fill_slots(struct pci_access *a)
 	   */
 	  if (res != 2)
 	    a->warning("sysfs_fill_slots: Couldn't parse entry address %s", buf);
+	  continue;
 	}
-      else
+
+      if (2*(count+1) > size)
+	{
+	  struct sysfs_slot *old = hash;
+	  size *= 2;
+	  hash = pci_malloc(a, size * sizeof(struct sysfs_slot));
+	  memset(hash, 0, size * sizeof(struct sysfs_slot));
+	  for (i=0; i<size/2; i++)
+	    if (old[i].used)
+	      *sysfs_find_slot(hash, size, old[i].domain, old[i].bus, old[i].dev) = old[i];
+	  pci_mfree(old);
+	}
+
+      /* If there are multiple slots with the same address, the first one wins */
+      s = sysfs_find_slot(hash, size, dom, bus, dev);
+      if (!s->used)
 	{
-	  for (d = a->devices; d; d = d->next)
-	    if (dom == (unsigned)d->domain && bus == d->bus && dev == d->dev && !d->phy_slot)
-	      d->phy_slot = pci_set_property(d, PCI_FILL_PHYS_SLOT, entry->d_name);
+	  s->used = 1;
+	  s->domain = dom;
+	  s->bus = bus;
+	  s->dev = dev;
+	  s->name = pci_strdup(a, entry->d_name);
+	  count++;
 	}
-      fclose(file);
     }
   closedir(dir);
+
+  if (count)
+    for (d = a->devices; d; d = d->next)
+      if (!d->phy_slot)
+	{
+	  s = sysfs_find_slot(hash, size, (unsigned int) d->domain, d->bus, d->dev);
+	  if (s->used)
+	    d->phy_slot = pci_set_property(d, PCI_FILL_PHYS_SLOT, s->name);
+	}
+
+  for (i=0; i<size; i++)
+    if (hash[i].used)
+      pci_mfree(hash[i].name);
+  pci_mfree(hash);
 }
 
 static void
 sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 {
+  struct sysfs_uevent ue = { .state = 0 };
+  unsigned int id1, id2;
+  char *val;
   int value, want_class, want_class_ext;
 
   if (!d->access->buscentric)
@@ -347,14 +867,27 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
        */
       if (want_fill(d, flags, PCI_FILL_IDENT))
 	{
-	  d->vendor_id = sysfs_get_value(d, "vendor", 1);
-	  d->device_id = sysfs_get_value(d, "device", 1);
+	  val = sysfs_uevent_get(d, &ue, "PCI_ID");
+	  if (val && sscanf(val, "%x:%x", &id1, &id2) == 2)
+	    {
+	      d->vendor_id = id1;
+	      d->device_id = id2;
+	    }
+	  else
+	    {
+	      d->vendor_id = sysfs_get_value(d, "vendor", 1);
+	      d->device_id = sysfs_get_value(d, "device", 1);
+	    }
 	}
       want_class = want_fill(d, flags, PCI_FILL_CLASS);
       want_class_ext = want_fill(d, flags, PCI_FILL_CLASS_EXT);
       if (want_class || want_class_ext)
         {
-	  value = sysfs_get_value(d, "class", 1);
+	  val = sysfs_uevent_get(d, &ue, "PCI_CLASS");
+	  if (val)
+	    value = strtol(val, NULL, 16);
+	  else
+	    value = sysfs_get_value(d, "class", 1);
 	  if (want_class)
 	    d->device_class = value >> 8;
 	  if (want_class_ext)
@@ -369,8 +902,13 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 	}
       if (want_fill(d, flags, PCI_FILL_SUBSYS))
 	{
-	  value = sysfs_get_value(d, "subsystem_vendor", 0);
-	  if (value >= 0)
+	  val = sysfs_uevent_get(d, &ue, "PCI_SUBSYS_ID");
+	  if (val && sscanf(val, "%x:%x", &id1, &id2) == 2)
+	    {
+	      d->subsys_vendor_id = id1;
+	      d->subsys_id = id2;
+	    }
+	  else if ((value = sysfs_get_value(d, "subsystem_vendor", 0)) >= 0)
 	    {
 	      d->subsys_vendor_id = value;
 	      value = sysfs_get_value(d, "subsystem_device", 0);
@@ -386,42 +924,11 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 	  sysfs_get_resources(d);
       if (want_fill(d, flags, PCI_FILL_PARENT))
 	{
-	  unsigned int domain, bus, dev, func;
-	  char *path_abs, *path_canon, *name;
-	  char path_rel[OBJNAMELEN];
-	  struct pci_dev *parent;
-
-	  /* Construct sysfs path for parent device */
-	  sysfs_obj_name(d, "..", path_rel);
-	  path_abs = realpath(path_rel, NULL);
-	  name = path_abs ? strrchr(path_abs, '/') : NULL;
-	  name = name ? name+1 : name;
-	  parent = NULL;
-
-	  if (name && sscanf(name, "%x:%x:%x.%d", &domain, &bus, &dev, &func) == 4 && domain <= 0x7fffffff)
-	    for (parent = d->access->devices; parent; parent = parent->next)
-	      if (parent->domain == (int)domain && parent->bus == bus && parent->dev == dev && parent->func == func)
-	        break;
-
-	  if (parent)
-	    {
-	      /* Check if parsed BDF address from parent sysfs device is really expected PCI device */
-	      sysfs_obj_name(parent, ".", path_rel);
-	      path_canon = realpath(path_rel, NULL);
-	      if (!path_canon || strcmp(path_canon, path_abs) != 0)
-	        parent = NULL;
-
-	      if (path_canon)
-		free(path_canon);
-	    }
-
+	  struct pci_dev *parent = sysfs_find_parent(d);
 	  if (parent)
 	    d->parent = parent;
 	  else
 	    clear_fill(d, PCI_FILL_PARENT);
-
-	  if (path_abs)
-	    free(path_abs);
 	}
     }
 
@@ -436,7 +943,14 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
   if (want_fill(d, flags, PCI_FILL_MODULE_ALIAS))
     {
       char buf[OBJBUFSIZE];
-      if (sysfs_get_string(d, "modalias", buf, 0))
+      /* The modalias attribute ends with a newline, keep the property the same */
+      val = sysfs_uevent_get(d, &ue, "MODALIAS");
+      if (val)
+	{
+	  snprintf(buf, sizeof(buf), "%s\n", val);
+	  d->module_alias = pci_set_property(d, PCI_FILL_MODULE_ALIAS, buf);
+	}
+      else if (sysfs_get_string(d, "modalias", buf, 0))
 	d->module_alias = pci_set_property(d, PCI_FILL_MODULE_ALIAS, buf);
     }
 
@@ -452,12 +966,9 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 
   if (want_fill(d, flags, PCI_FILL_IOMMU_GROUP))
     {
-      char *group_link = sysfs_deref_link(d, "iommu_group");
-      if (group_link)
-        {
-          pci_set_property(d, PCI_FILL_IOMMU_GROUP, basename(group_link));
-          free(group_link);
-        }
+      char buf[OBJNAMELEN], *group = sysfs_link_basename(d, "iommu_group", buf, sizeof(buf));
+      if (group)
+	pci_set_property(d, PCI_FILL_IOMMU_GROUP, group);
     }
 
   if (want_fill(d, flags, PCI_FILL_DT_NODE))
@@ -472,14 +983,14 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
 
   if (want_fill(d, flags, PCI_FILL_DRIVER))
     {
-      char *driver_path = sysfs_deref_link(d, "driver");
-      if (driver_path)
-        {
-          char *driver = strrchr(driver_path, '/');
-          driver = driver ? driver+1 : driver_path;
-          pci_set_property(d, PCI_FILL_DRIVER, driver);
-          free(driver_path);
-        }
+      char buf[OBJNAMELEN], *driver;
+      /* uevent lists DRIVER only when one is bound, so its absence is meaningful there */
+      if (sysfs_uevent_get(d, &ue, "PCI_ID"))
+	driver = sysfs_uevent_get(d, &ue, "DRIVER");
+      else
+	driver = sysfs_link_basename(d, "driver", buf, sizeof(buf));
+      if (driver)
+	pci_set_property(d, PCI_FILL_DRIVER, driver);
       else
         clear_fill(d, PCI_FILL_DRIVER);
     }
@@ -498,6 +1009,49 @@ sysfs_fill_info(struct pci_dev *d, unsigned int flags)
   pci_generic_fill_info(d, flags);
 }
 
+#ifdef PCI_HAVE_PTHREADS
+
+static void sysfs_worker_locked(int locked);
+static void sysfs_worker_pinned(struct sysfs_dev *sd, int delta);
+
+static inline void
+sysfs_lock(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+  if (sa->threaded)
+    {
+      pthread_mutex_lock(&sa->lock);
+      sysfs_worker_locked(1);
+    }
+}
+
+static inline void
+sysfs_unlock(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+  if (sa->threaded)
+    {
+      sysfs_worker_locked(0);
+      pthread_mutex_unlock(&sa->lock);
+    }
+}
+
+static inline void
+sysfs_worker_pin(struct pci_access *a, struct sysfs_dev *sd, int delta)
+{
+  struct sysfs_access *sa = a->backend_data;
+  if (sa->threaded)
+    sysfs_worker_pinned(sd, delta);
+}
+
+#else
+
+static inline void sysfs_lock(struct pci_access *a UNUSED) { }
+static inline void sysfs_unlock(struct pci_access *a UNUSED) { }
+static inline void sysfs_worker_pin(struct pci_access *a UNUSED, struct sysfs_dev *sd UNUSED, int delta UNUSED) { }
+
+#endif
+
 /* Intent of the sysfs_setup() caller */
 enum
   {
@@ -506,51 +1060,120 @@ enum
     SETUP_READ_VPD = 2
   };
 
+/*
+ *  Close fds of the least recently used device, skipping devices other
+ *  threads are just reading from. If all of them are busy, the cache
+ *  temporarily grows above its limit.
+ */
+static int
+sysfs_lru_evict(struct sysfs_access *sa)
+{
+  struct sysfs_dev *sd;
+
+  for (sd = sa->lru_last; sd; sd = sd->lru_prev)
+    if (!sd->users)
+      {
+	sysfs_close_fds(sa, sd);
+	return 1;
+      }
+  return 0;
+}
+
 static int
 sysfs_setup(struct pci_dev *d, int intent)
 {
   struct pci_access *a = d->access;
+  struct sysfs_access *sa = a->backend_data;
+  struct sysfs_dev *sd = sysfs_dev_data(d);
   char namebuf[OBJNAMELEN];
+  int *fdp = (intent == SETUP_READ_VPD) ? &sd->fd_vpd : &sd->fd;
 
-  if (a->cached_dev != d || (intent == SETUP_WRITE_CONFIG && !a->fd_rw))
+  if (*fdp >= 0 && (intent != SETUP_WRITE_CONFIG || sd->fd_rw))
     {
-      sysfs_flush_cache(a);
-      a->cached_dev = d;
+      a->fd_cache_hits++;
+      if (sa->lru_first != sd)
+	{
+	  sysfs_lru_unlink(sa, sd);
+	  sysfs_lru_insert(sa, sd);
+	}
+      return *fdp;
     }
+  a->fd_cache_misses++;
+
+  /* Make room for the new device, or take it out of the list while we re-open its fds */
+  if (sysfs_lru_member(sd))
+    sysfs_lru_unlink(sa, sd);
+  else
+    while (sa->lru_count >= sa->lru_max && sysfs_lru_evict(sa))
+      ;
 
   if (intent == SETUP_READ_VPD)
     {
-      if (a->fd_vpd < 0)
+      sd->fd_vpd = sysfs_open_obj(d, "vpd", O_RDONLY);
+      /* No warning on error; vpd may be absent or accessible only to root */
+    }
+  else
+    {
+      if (sd->fd >= 0)
+	close(sd->fd);
+      sd->fd_rw = a->writeable || intent == SETUP_WRITE_CONFIG;
+      sd->fd = sysfs_open_obj(d, "config", sd->fd_rw ? O_RDWR : O_RDONLY);
+      if (sd->fd < 0)
 	{
-	  sysfs_obj_name(d, "vpd", namebuf);
-	  a->fd_vpd = open(namebuf, O_RDONLY);
-	  /* No warning on error; vpd may be absent or accessible only to root */
+	  sysfs_obj_name(d, "config", namebuf);
+	  a->warning("Cannot open %s", namebuf);
 	}
-      return a->fd_vpd;
     }
 
-  if (a->fd < 0)
+  if (sysfs_lru_member(sd))
+    sysfs_lru_insert(sa, sd);
+  return *fdp;
+}
+
+/*
+ *  The lock protects only the fd cache, not the I/O itself. While a thread
+ *  is using an fd, the device is pinned, so that other threads making room
+ *  in the cache do not close it. Writes and re-opening of fds for writing
+ *  never happen in parallel with other threads.
+ */
+static int
+sysfs_get_fd(struct pci_dev *d, int intent)
+{
+  int fd;
+
+  sysfs_lock(d->access);
+  fd = sysfs_setup(d, intent);
+  if (fd >= 0)
     {
-      sysfs_obj_name(d, "config", namebuf);
-      a->fd_rw = a->writeable || intent == SETUP_WRITE_CONFIG;
-      a->fd = open(namebuf, a->fd_rw ? O_RDWR : O_RDONLY);
-      if (a->fd < 0)
-	a->warning("Cannot open %s", namebuf);
+      sysfs_dev_data(d)->users++;
+      sysfs_worker_pin(d->access, sysfs_dev_data(d), 1);
     }
-  return a->fd;
+  sysfs_unlock(d->access);
+  return fd;
+}
+
+static void
+sysfs_put_fd(struct pci_dev *d)
+{
+  sysfs_lock(d->access);
+  sysfs_dev_data(d)->users--;
+  sysfs_worker_pin(d->access, sysfs_dev_data(d), -1);
+  sysfs_unlock(d->access);
 }
 
 static int sysfs_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  int fd = sysfs_setup(d, SETUP_READ_CONFIG);
-  int res;
+  int fd, res, err;
 
+  fd = sysfs_get_fd(d, SETUP_READ_CONFIG);
   if (fd < 0)
     return 0;
   res = pread(fd, buf, len, pos);
+  err = errno;
+  sysfs_put_fd(d);
   if (res < 0)
     {
-      d->access->warning("sysfs_read: read failed: %s", strerror(errno));
+      d->access->warning("sysfs_read: read failed: %s", strerror(err));
       return 0;
     }
   else if (res != len)
@@ -560,15 +1183,17 @@ static int sysfs_read(struct pci_dev *d, int pos, byte *buf, int len)
 
 static int sysfs_write(struct pci_dev *d, int pos, byte *buf, int len)
 {
-  int fd = sysfs_setup(d, SETUP_WRITE_CONFIG);
-  int res;
+  int fd, res, err;
 
+  fd = sysfs_get_fd(d, SETUP_WRITE_CONFIG);
   if (fd < 0)
     return 0;
   res = pwrite(fd, buf, len, pos);
+  err = errno;
+  sysfs_put_fd(d);
   if (res < 0)
     {
-      d->access->warning("sysfs_write: write failed: %s", strerror(errno));
+      d->access->warning("sysfs_write: write failed: %s", strerror(err));
       return 0;
     }
   else if (res != len)
@@ -579,30 +1204,1045 @@ static int sysfs_write(struct pci_dev *d, int pos, byte *buf, int len)
   return 1;
 }
 
-static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
+/*
+ *  Reading VPD is slow: the kernel has to go through the VPD address and
+ *  data registers for every 4 bytes and some devices take milliseconds to
+ *  respond. As callers parse VPD in many small pieces, we read it a whole
+ *  resource at a time and serve all further requests from memory. We never
+ *  read past the end tag or further than the caller has asked for.
+ *
+ *  If sysfs.vpd_cache_dir is set, complete VPD is also stored there, keyed
+ *  by the device address and the boot ID, so that it survives until the
+ *  next boot. The inode number of the device directory is recorded, too,
+ *  so that a device hot-plugged to the same address later is not mistaken
+ *  for the original one.
+ */
+
+#define VPD_MAX_SIZE 32768		/* The kernel does not allow more */
+
+static int
+sysfs_vpd_cache_name(struct pci_dev *d, char *buf, unsigned long long *ino)
 {
-  int fd = sysfs_setup(d, SETUP_READ_VPD);
-  int res;
+  struct pci_access *a = d->access;
+  struct sysfs_access *sa = a->backend_data;
+  char *dir = pci_get_param(a, "sysfs.vpd_cache_dir");
+  char name[OBJNAMELEN], boot_id[64];
+  struct stat st;
+  int fd, n;
 
-  if (fd < 0)
+  if (!dir[0])
     return 0;
-  res = pread(fd, buf, len, pos);
-  if (res < 0)
+
+  /* Shared by all threads; allocation failures are not fatal here, we just try again */
+  sysfs_lock(a);
+  if (!sa->boot_id)
     {
-      d->access->warning("sysfs_read_vpd: read failed: %s", strerror(errno));
-      return 0;
+      char id[64];
+      fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+      n = (fd < 0) ? -1 : read(fd, id, sizeof(id) - 1);
+      if (fd >= 0)
+	close(fd);
+      while (n > 0 && id[n-1] == '\n')
+	n--;
+      id[n > 0 ? n : 0] = 0;
+      sa->boot_id = strdup(id);
     }
-  else if (res != len)
+  n = snprintf(boot_id, sizeof(boot_id), "%s", sa->boot_id ? sa->boot_id : "");
+  sysfs_unlock(a);
+  if (n <= 0 || n >= (int) sizeof(boot_id))
     return 0;
-  return 1;
+
+  fd = sysfs_dev_dir(d);
+  if (fd >= 0)
+    n = fstat(fd, &st);
+  else
+    {
+      sysfs_obj_name(d, ".", name);
+      n = stat(name, &st);
+    }
+  if (n < 0)
+    return 0;
+  *ino = st.st_ino;
+
+  n = snprintf(buf, OBJNAMELEN, "%s/%s-%04x:%02x:%02x.%d", dir, boot_id, d->domain, d->bus, d->dev, d->func);
+  return n > 0 && n < OBJNAMELEN;
+}
+
+static int
+sysfs_vpd_load_disk(struct pci_dev *d, char *name, unsigned long long ino)
+{
+  struct sysfs_dev *sd = d->backend_data;
+  byte *buf = pci_malloc(d->access, VPD_MAX_SIZE + 64);
+  unsigned long long file_ino;
+  int fd, n = 0, res, len, hdr;
+
+  fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      pci_mfree(buf);
+      return 0;
+    }
+  while (n < VPD_MAX_SIZE + 63 && (res = read(fd, buf + n, VPD_MAX_SIZE + 63 - n)) > 0)
+    n += res;
+  close(fd);
+  buf[n] = 0;
+
+  if (sscanf((char *) buf, "pcilib-vpd %llu %d\n%n", &file_ino, &len, &hdr) != 2 ||
+      file_ino != ino || len < 0 || len > VPD_MAX_SIZE || hdr + len != n)
+    {
+      d->access->debug("sysfs: Ignoring stale VPD cache %s\n", name);
+      pci_mfree(buf);
+      return 0;
+    }
+
+  memmove(buf, buf + hdr, len);
+  sd->vpd = buf;
+  sd->vpd_len = sd->vpd_alloc = len;
+  sd->vpd_complete = 1;
+  return 1;
+}
+
+static void
+sysfs_vpd_save_disk(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = d->backend_data;
+  char name[OBJNAMELEN], tmp[OBJNAMELEN + 16], hdr[64];
+  unsigned long long ino;
+  int fd, n, ok;
+
+  if (!sysfs_vpd_cache_name(d, name, &ino))
+    return;
+
+  /* Write a temporary file and rename it, so that readers never see a partial file */
+  n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+  if (n < 0 || n >= (int) sizeof(tmp))
+    return;
+  fd = mkstemp(tmp);
+  if (fd < 0)
+    {
+      d->access->debug("sysfs: Cannot create %s: %s\n", tmp, strerror(errno));
+      return;
+    }
+  n = sprintf(hdr, "pcilib-vpd %llu %d\n", ino, sd->vpd_len);
+  ok = (write(fd, hdr, n) == n && write(fd, sd->vpd, sd->vpd_len) == sd->vpd_len);
+  ok = !close(fd) && ok;
+  if (!ok || rename(tmp, name) < 0)
+    {
+      d->access->debug("sysfs: Cannot write %s\n", name);
+      unlink(tmp);
+    }
+}
+
+/* Extend the cached VPD to the given length. Returns 0 at the end of VPD, -1 on errors. */
+static int
+sysfs_vpd_fill(struct pci_dev *d, int fd, int end)
+{
+  struct sysfs_dev *sd = d->backend_data;
+  int res;
+
+  if (end > VPD_MAX_SIZE)
+    end = VPD_MAX_SIZE;
+  if (end > sd->vpd_alloc)
+    {
+      sd->vpd_alloc = (2 * sd->vpd_alloc < VPD_MAX_SIZE) ? 2 * sd->vpd_alloc : VPD_MAX_SIZE;
+      if (sd->vpd_alloc < end)
+	sd->vpd_alloc = end;
+      sd->vpd = pci_realloc(d->access, sd->vpd, sd->vpd_alloc);
+    }
+  while (sd->vpd_len < end)
+    {
+      res = pread(fd, sd->vpd + sd->vpd_len, end - sd->vpd_len, sd->vpd_len);
+      if (res < 0 && errno == EINTR)
+	continue;
+      if (res < 0)
+	return -1;
+      if (!res)
+	return 0;
+      sd->vpd_len += res;
+    }
+  return sd->vpd_len < VPD_MAX_SIZE;
+}
+
+/* The cached VPD belongs to the device, so it needs no locking */
+static void
+sysfs_vpd_read_upto(struct pci_dev *d, int want)
+{
+  struct sysfs_dev *sd = sysfs_dev_data(d);
+  int fd, res, next;
+  byte tag;
+
+  fd = sysfs_get_fd(d, SETUP_READ_VPD);
+  if (fd < 0)
+    {
+      sd->vpd_complete = 1;
+      return;
+    }
+
+  /* Resource headers are at most 3 bytes long, the small end tag is just 1 */
+  res = 1;
+  while (sd->vpd_len < want && res > 0)
+    {
+      next = sd->vpd_next;
+      if ((res = sysfs_vpd_fill(d, fd, next + 3)) < 0 || sd->vpd_len <= next)
+	break;
+      tag = sd->vpd[next];
+      if (tag & 0x80)
+	{
+	  if (sd->vpd_len < next + 3)
+	    break;
+	  sd->vpd_next = next + 3 + (sd->vpd[next+1] | (sd->vpd[next+2] << 8));
+	}
+      else
+	sd->vpd_next = next + 1 + (tag & 7);
+      res = sysfs_vpd_fill(d, fd, sd->vpd_next);
+      if (!(tag & 0x80) && (tag >> 3) == 0x0f)
+	{
+	  /* End tag: whatever follows is not VPD */
+	  if (res >= 0 && sd->vpd_len > sd->vpd_next)
+	    sd->vpd_len = sd->vpd_next;
+	  res = 0;
+	}
+    }
+  sysfs_put_fd(d);
+
+  if (res < 0)
+    {
+      /* Let the uncached path try again and report the error */
+      pci_mfree(sd->vpd);
+      sd->vpd = NULL;
+      sd->vpd_len = -2;
+      return;
+    }
+  if (!res)
+    {
+      sd->vpd_complete = 1;
+      sysfs_vpd_save_disk(d);
+    }
+}
+
+static void
+sysfs_vpd_load(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = sysfs_dev_data(d);
+  char name[OBJNAMELEN];
+  unsigned long long ino;
+
+  if (sysfs_vpd_cache_name(d, name, &ino) && sysfs_vpd_load_disk(d, name, ino))
+    return;
+  sd->vpd_len = 0;
+}
+
+static int sysfs_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct sysfs_access *sa = d->access->backend_data;
+  struct sysfs_dev *sd;
+  int fd, res, err;
+
+  if (sa->vpd_cache && pos >= 0 && len >= 0 && pos <= VPD_MAX_SIZE - len)
+    {
+      sd = sysfs_dev_data(d);
+      if (sd->vpd_len == -1)
+	sysfs_vpd_load(d);
+      if (sd->vpd_len >= 0 && !sd->vpd_complete && pos + len > sd->vpd_len)
+	sysfs_vpd_read_upto(d, pos + len);
+      if (sd->vpd_len >= 0)
+	{
+	  res = (pos <= sd->vpd_len - len);
+	  if (res)
+	    memcpy(buf, sd->vpd + pos, len);
+	  return res;
+	}
+    }
+  fd = sysfs_get_fd(d, SETUP_READ_VPD);
+  if (fd < 0)
+    return 0;
+  res = pread(fd, buf, len, pos);
+  err = errno;
+  sysfs_put_fd(d);
+  if (res < 0)
+    {
+      d->access->warning("sysfs_read_vpd: read failed: %s", strerror(err));
+      return 0;
+    }
+  else if (res != len)
+    return 0;
+  return 1;
+}
+
+#ifdef PCI_HAVE_IO_URING
+
+/*
+ *  Batched reads of config space via io_uring. Reads of sysfs attributes
+ *  cannot complete without blocking, so the kernel hands them over to its
+ *  worker threads and the reads of different devices overlap instead of
+ *  waiting for each other. The interface is simple enough to be used via
+ *  plain system calls, so we do not need liburing.
+ */
+
+#define URING_ENTRIES 64
+
+struct sysfs_uring {
+  int fd;
+  unsigned int entries;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static void
+sysfs_uring_close(struct sysfs_access *sa)
+{
+  struct sysfs_uring *u = sa->uring;
+
+  if (!u)
+    return;
+  if (u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring != MAP_FAILED)
+    munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+  pci_mfree(u);
+  sa->uring = NULL;
+}
+
+static struct sysfs_uring *
+sysfs_uring_open(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+  struct io_uring_params p;
+  struct sysfs_uring *u;
+  int fd;
+
+  if (sa->uring || sa->uring_failed)
+    return sa->uring;
+  sa->uring_failed = 1;
+
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd < 0)
+    {
+      a->debug("sysfs: io_uring not available: %s\n", strerror(errno));
+      return NULL;
+    }
+
+  u = pci_malloc(a, sizeof(*u));
+  sa->uring = u;
+  u->fd = fd;
+  u->entries = p.sq_entries;
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (u->cq_ring_size > u->sq_ring_size)
+	u->sq_ring_size = u->cq_ring_size;
+      u->cq_ring_size = u->sq_ring_size;
+    }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->cq_ring = u->sq_ring;
+  else
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+      a->debug("sysfs: cannot map io_uring: %s\n", strerror(errno));
+      sysfs_uring_close(sa);
+      return NULL;
+    }
+
+  u->sq_head = (unsigned int *)((char *) u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned int *)((char *) u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned int *)((char *) u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned int *)((char *) u->sq_ring + p.sq_off.array);
+  u->cq_head = (unsigned int *)((char *) u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned int *)((char *) u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned int *)((char *) u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *) u->cq_ring + p.cq_off.cqes);
+
+  sa->uring_failed = 0;
+  return u;
+}
+
+/*
+ *  Submit reads for at most u->entries requests and wait for all of them.
+ *  Requests which could not be submitted or which failed in the kernel
+ *  are retried by sysfs_read(), so that errors get reported as usual.
+ */
+static int
+sysfs_uring_read_chunk(struct pci_access *a, struct sysfs_uring *u, struct pci_read_request *req, int n)
+{
+  struct sysfs_access *sa = a->backend_data;
+  unsigned int tail, head, idx;
+  int i, fd, queued, pending, ok, done, einval;
+
+  tail = *u->sq_tail;
+  queued = 0;
+  for (i=0; i<n; i++)
+    {
+      struct io_uring_sqe *sqe;
+
+      req[i].status = 0;
+      fd = sysfs_setup(req[i].dev, SETUP_READ_CONFIG);
+      if (fd < 0)
+	continue;
+      idx = tail & *u->sq_mask;
+      sqe = &u->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->off = req[i].pos;
+      sqe->addr = (unsigned long) req[i].buf;
+      sqe->len = req[i].len;
+      sqe->user_data = i;
+      u->sq_array[idx] = idx;
+      tail++;
+      req[i].status = -1;
+      queued++;
+    }
+  __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+  pending = queued ? syscall(__NR_io_uring_enter, u->fd, queued, 0, 0, NULL, 0) : 0;
+  if (pending < queued)
+    {
+      /* Take back what the kernel did not accept and give up on io_uring */
+      a->debug("sysfs: io_uring submission failed: %s\n", (pending < 0) ? strerror(errno) : "short");
+      if (pending < 0)
+	pending = 0;
+      *u->sq_tail = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+      sa->uring_failed = 1;
+    }
+
+  done = einval = 0;
+  while (pending > 0)
+    {
+      head = *u->cq_head;
+      tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail)
+	{
+	  if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+	    a->error("sysfs: waiting for io_uring failed: %s", strerror(errno));
+	  continue;
+	}
+      for (; head != tail; head++)
+	{
+	  struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+	  struct pci_read_request *r = &req[cqe->user_data];
+	  if (cqe->res >= 0)
+	    r->status = (cqe->res == r->len);
+	  else if (cqe->res == -EINVAL)
+	    einval++;
+	  done++;
+	  pending--;
+	}
+      __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  /* Kernels which know io_uring, but not IORING_OP_READ, reject all reads */
+  if (done && einval == done)
+    {
+      a->debug("sysfs: io_uring reads rejected by the kernel\n");
+      sa->uring_failed = 1;
+    }
+  if (sa->uring_failed)
+    sysfs_uring_close(sa);
+
+  ok = 0;
+  for (i=0; i<n; i++)
+    {
+      if (req[i].status < 0)
+	req[i].status = sysfs_read(req[i].dev, req[i].pos, req[i].buf, req[i].len);
+      ok += req[i].status;
+    }
+  return ok;
+}
+
+static int
+sysfs_read_blocks(struct pci_access *a, struct pci_read_request *req, int n)
+{
+  struct sysfs_access *sa = a->backend_data;
+  struct sysfs_uring *u;
+  int i, chunk, ok = 0;
+
+  for (i=0; i<n; i += chunk)
+    {
+      u = sysfs_uring_open(a);
+      if (!u)
+	{
+	  req[i].status = sysfs_read(req[i].dev, req[i].pos, req[i].buf, req[i].len);
+	  ok += req[i].status;
+	  chunk = 1;
+	  continue;
+	}
+      /* All fds of a chunk must stay in the fd cache until the chunk is submitted */
+      chunk = u->entries;
+      if (chunk > sa->lru_max)
+	chunk = sa->lru_max;
+      if (chunk > n-i)
+	chunk = n-i;
+      ok += sysfs_uring_read_chunk(a, u, req+i, chunk);
+    }
+  return ok;
+}
+
+#else
+
+static void sysfs_uring_close(struct sysfs_access *sa UNUSED) { }
+
+#endif
+
+#ifdef PCI_HAVE_PTHREADS
+
+/*
+ *  Filling of device information for many devices in parallel. Each device
+ *  is processed by a single thread, which touches only the device itself,
+ *  except for the fd cache (protected by sa->lock) and physical slots (which
+ *  are filled for all devices at once, so we do it before starting the threads).
+ *  Warnings and debug messages are collected per device and passed to the real
+ *  callbacks afterwards in the order of devices, so the output does not depend
+ *  on timing.
+ *
+ *  The callbacks do not get any context, so each worker thread keeps a pointer
+ *  to its state in a thread-specific value. The key is created once, but the
+ *  values belong to the threads, so batches running on different pci_access
+ *  structures at the same time do not interfere.
+ *
+ *  Errors are fatal: the first one stops all workers and it is passed to
+ *  the real error callback in the thread which called pci_prefetch_info().
+ *  A worker hitting an error exits immediately, releasing the lock and its
+ *  pin of a device in the fd cache, but not memory allocated by the fill
+ *  in progress. If the error callback returns, the pci_access stays usable,
+ *  but the interrupted devices can miss some fields and memory can leak.
+ */
+
+struct sysfs_msg {
+  struct sysfs_msg *next;
+  int is_debug;
+  char text[1];
+};
+
+struct sysfs_prefetch {
+  struct pci_access *a;
+  struct pci_dev **devs;
+  int n, next;
+  unsigned int flags;
+  pthread_mutex_t lock;			/* Protects next and failed */
+  int failed;
+  char error_msg[1024];			/* The first error reported by a worker */
+  struct sysfs_msg **msgs;
+};
+
+struct sysfs_worker {
+  struct sysfs_prefetch *pf;
+  struct sysfs_msg **tail;		/* Where to append messages of the current device */
+  int locked;				/* We hold sa->lock */
+  struct sysfs_dev *pinned;		/* Device whose fd we are using (never more than one at a time) */
+  int pins;				/* ... and how many times it is pinned by us */
+};
+
+static pthread_key_t sysfs_worker_key;
+static pthread_once_t sysfs_worker_once = PTHREAD_ONCE_INIT;
+
+static void
+sysfs_worker_key_init(void)
+{
+  pthread_key_create(&sysfs_worker_key, NULL);
+}
+
+static void
+sysfs_worker_locked(int locked)
+{
+  struct sysfs_worker *w = pthread_getspecific(sysfs_worker_key);
+
+  if (w)
+    w->locked = locked;
+}
+
+static void
+sysfs_worker_pinned(struct sysfs_dev *sd, int delta)
+{
+  struct sysfs_worker *w = pthread_getspecific(sysfs_worker_key);
+
+  if (w)
+    {
+      w->pinned = sd;
+      w->pins += delta;
+    }
+}
+
+static void
+sysfs_worker_msg(int is_debug, char *msg, va_list args)
+{
+  struct sysfs_worker *w = pthread_getspecific(sysfs_worker_key);
+  char buf[1024];
+  struct sysfs_msg *m;
+
+  vsnprintf(buf, sizeof(buf), msg, args);
+  /* Not pci_malloc(), whose failure would be reported as an error with sa->lock held */
+  m = malloc(sizeof(*m) + strlen(buf));
+  if (!m)
+    return;
+  m->next = NULL;
+  m->is_debug = is_debug;
+  strcpy(m->text, buf);
+  *w->tail = m;
+  w->tail = &m->next;
+}
+
+static void
+sysfs_worker_warning(char *msg, ...)
+{
+  va_list args;
+
+  va_start(args, msg);
+  sysfs_worker_msg(0, msg, args);
+  va_end(args);
+}
+
+static void
+sysfs_worker_debug(char *msg, ...)
+{
+  va_list args;
+
+  va_start(args, msg);
+  sysfs_worker_msg(1, msg, args);
+  va_end(args);
+}
+
+static void PCI_NONRET
+sysfs_worker_error(char *msg, ...)
+{
+  struct sysfs_worker *w = pthread_getspecific(sysfs_worker_key);
+  struct sysfs_prefetch *pf = w->pf;
+  struct sysfs_access *sa = pf->a->backend_data;
+  va_list args;
+
+  /* We are not coming back, so let the fd cache evict the device we were using */
+  if (!w->locked)
+    pthread_mutex_lock(&sa->lock);
+  if (w->pins > 0)
+    w->pinned->users -= w->pins;
+  w->pins = 0;
+  w->locked = 0;
+  pthread_mutex_unlock(&sa->lock);
+
+  pthread_mutex_lock(&pf->lock);
+  if (!pf->failed)
+    {
+      va_start(args, msg);
+      vsnprintf(pf->error_msg, sizeof(pf->error_msg), msg, args);
+      va_end(args);
+      pf->failed = 1;
+    }
+  pthread_mutex_unlock(&pf->lock);
+  pthread_exit(NULL);
+}
+
+static void *
+sysfs_worker(void *arg)
+{
+  struct sysfs_prefetch *pf = arg;
+  struct sysfs_worker w = { .pf = pf };
+  int i;
+
+  pthread_setspecific(sysfs_worker_key, &w);
+  for (;;)
+    {
+      pthread_mutex_lock(&pf->lock);
+      i = pf->failed ? pf->n : pf->next++;
+      pthread_mutex_unlock(&pf->lock);
+      if (i >= pf->n)
+	break;
+      w.tail = &pf->msgs[i];
+      pci_fill_info_v313(pf->devs[i], pf->flags);
+    }
+  return NULL;
+}
+
+static int
+sysfs_threads(struct pci_access *a)
+{
+  int n = atoi(pci_get_param(a, "sysfs.threads"));
+
+  if (n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 64) ? n : 64;
+}
+
+static void
+sysfs_prefetch_info(struct pci_access *a, struct pci_dev **devs, int n, unsigned int flags)
+{
+  struct sysfs_access *sa = a->backend_data;
+  struct sysfs_prefetch pf;
+  struct sysfs_msg *m, *next;
+  void (*error)(char *msg, ...) PCI_PRINTF(1,2) PCI_NONRET;
+  void (*warning)(char *msg, ...) PCI_PRINTF(1,2);
+  void (*debug)(char *msg, ...) PCI_PRINTF(1,2);
+  pthread_t *threads;
+  int i, nthreads = sysfs_threads(a), started;
+  int *running;
+
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads > 1)
+    {
+      /* Make sure all state shared between devices is set up before we go parallel */
+      sysfs_dev_dir(devs[0]);
+      if (sa->devices_fd < 0 || (flags & PCI_FILL_RESCAN) || pthread_once(&sysfs_worker_once, sysfs_worker_key_init))
+	nthreads = 1;
+    }
+  if (nthreads <= 1)
+    {
+      for (i=0; i<n; i++)
+	pci_fill_info_v313(devs[i], flags);
+      return;
+    }
+  if (flags & PCI_FILL_PARENT)
+    {
+      struct pci_dev *d;
+      sysfs_drop_index(a);
+      sysfs_build_index(a);
+      for (d = a->devices; d; d = d->next)
+	sysfs_canon_path(d);
+    }
+  if (flags & PCI_FILL_PHYS_SLOT)
+    for (i=0; i<n; i++)
+      if (!(devs[i]->known_fields & PCI_FILL_PHYS_SLOT))
+	{
+	  pci_fill_info_v313(devs[i], PCI_FILL_PHYS_SLOT);
+	  break;
+	}
+
+  memset(&pf, 0, sizeof(pf));
+  pf.a = a;
+  pf.devs = devs;
+  pf.n = n;
+  pf.flags = flags;
+  pf.msgs = pci_malloc(a, n * sizeof(struct sysfs_msg *));
+  memset(pf.msgs, 0, n * sizeof(struct sysfs_msg *));
+  pthread_mutex_init(&pf.lock, NULL);
+  threads = pci_malloc(a, nthreads * sizeof(pthread_t));
+  running = pci_malloc(a, nthreads * sizeof(int));
+
+  error = a->error;
+  warning = a->warning;
+  debug = a->debug;
+  a->error = sysfs_worker_error;
+  a->warning = sysfs_worker_warning;
+  a->debug = sysfs_worker_debug;
+  sa->threaded = 1;
+
+  /* Workers can exit on errors, so this thread only waits for them */
+  started = 0;
+  for (i=0; i<nthreads; i++)
+    started += running[i] = !pthread_create(&threads[i], NULL, sysfs_worker, &pf);
+  for (i=0; i<nthreads; i++)
+    if (running[i])
+      pthread_join(threads[i], NULL);
+
+  sa->threaded = 0;
+  a->error = error;
+  a->warning = warning;
+  a->debug = debug;
+
+  for (i=0; i<n; i++)
+    for (m = pf.msgs[i]; m; m = next)
+      {
+	next = m->next;
+	(m->is_debug ? a->debug : a->warning)("%s", m->text);
+	free(m);
+      }
+
+  pthread_mutex_destroy(&pf.lock);
+  pci_mfree(running);
+  pci_mfree(threads);
+  pci_mfree(pf.msgs);
+
+  /* Error callbacks are not supposed to return, but let us survive if one does (see above) */
+  if (pf.failed)
+    {
+      void (*report)(char *msg, ...) = a->error;
+      report("%s", pf.error_msg);
+    }
+
+  /* If no thread could be started, do the work ourselves */
+  if (!started)
+    for (i=0; i<n; i++)
+      pci_fill_info_v313(devs[i], flags);
+}
+
+#endif
+
+static void
+sysfs_free_dev_data(struct pci_dev *d)
+{
+  struct sysfs_dev *sd = d->backend_data;
+
+  if (sd)
+    {
+      sysfs_close_fds(d->access->backend_data, sd);
+      free(sd->canon_path);
+      pci_mfree(sd->vpd);
+      if (sd->dir_fd >= 0)
+	close(sd->dir_fd);
+      pci_mfree(sd);
+      d->backend_data = NULL;
+    }
 }
 
 static void sysfs_cleanup_dev(struct pci_dev *d)
 {
-  struct pci_access *a = d->access;
+  sysfs_drop_index(d->access);
+  sysfs_free_dev_data(d);
+}
+
+/*
+ *  Hot-plug events: the kernel announces devices being added and removed
+ *  by uevents sent to a netlink socket. We update the list of devices
+ *  according to them. If there is no socket or we lost some events, we
+ *  compare the list with the devices directory instead.
+ */
+
+static int
+sysfs_hotplug_open(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+  struct sockaddr_nl addr;
+  int fd, size = 1 << 20;
 
-  if (a->cached_dev == d)
-    sysfs_flush_cache(a);
+  if (sa->uevent_fd >= 0)
+    return sa->uevent_fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    {
+      a->debug("sysfs: Cannot open uevent socket: %s\n", strerror(errno));
+      return -1;
+    }
+
+  /* Bursts of events (e.g., enabling many VFs) should not overflow the socket */
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;			/* Events sent by the kernel, not by udev */
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+      a->debug("sysfs: Cannot bind uevent socket: %s\n", strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+  sa->uevent_fd = fd;
+  return fd;
+}
+
+static void
+sysfs_hotplug_reset(struct pci_dev *d)
+{
+  /* Forget everything we know, including the directory and open files */
+  sysfs_free_dev_data(d);
+  pci_reset_properties(d);
+}
+
+static void
+sysfs_hotplug_remove(struct pci_access *a, struct pci_dev *d)
+{
+  pci_unlink_dev(a, d);
+  pci_free_dev(d);
+}
+
+static struct pci_dev *
+sysfs_hotplug_add(struct pci_access *a, unsigned int dom, unsigned int bus, unsigned int dev, unsigned int func)
+{
+  struct pci_dev *d = pci_get_dev(a, dom, bus, dev, func);
+
+  pci_link_dev(a, d);
+  sysfs_drop_index(a);
+  return d;
+}
+
+static struct pci_dev *
+sysfs_hotplug_find(struct pci_access *a, unsigned int dom, unsigned int bus, unsigned int dev, unsigned int func)
+{
+  struct sysfs_access *sa = a->backend_data;
+
+  if (!sa->index)
+    sysfs_build_index(a);
+  return sa->index[sysfs_index_find(sa, dom, bus, dev, func)];
+}
+
+static int
+sysfs_hotplug_event(struct pci_access *a, const char *msg, int len)
+{
+  char buf[8192], *p, *end, *action = NULL, *subsystem = NULL, *slot = NULL, *devpath = NULL;
+  unsigned int dom, bus, dev, func;
+  struct pci_dev *d;
+
+  if (len < 0 || len >= (int) sizeof(buf))
+    return 0;
+  memcpy(buf, msg, len);
+  buf[len] = 0;
+  end = buf + len;
+
+  /* The first string is "ACTION@DEVPATH", which does not contain '=' and gets ignored */
+  for (p = buf; p < end; p += strlen(p) + 1)
+    if (!strncmp(p, "ACTION=", 7))
+      action = p + 7;
+    else if (!strncmp(p, "SUBSYSTEM=", 10))
+      subsystem = p + 10;
+    else if (!strncmp(p, "PCI_SLOT_NAME=", 14))
+      slot = p + 14;
+    else if (!strncmp(p, "DEVPATH=", 8))
+      devpath = p + 8;
+
+  if (!action || !subsystem || strcmp(subsystem, "pci"))
+    return 0;
+  if (!slot && devpath && (slot = strrchr(devpath, '/')))
+    slot++;
+  if (!slot || sscanf(slot, "%x:%x:%x.%d", &dom, &bus, &dev, &func) != 4 || dom > 0x7fffffff)
+    {
+      a->debug("sysfs: Ignoring uevent for unknown device %s\n", slot ? slot : "?");
+      return 0;
+    }
+
+  a->debug("sysfs: uevent %s %04x:%02x:%02x.%d\n", action, dom, bus, dev, func);
+  d = sysfs_hotplug_find(a, dom, bus, dev, func);
+  if (!strcmp(action, "remove"))
+    {
+      if (!d)
+	return 0;
+      sysfs_hotplug_remove(a, d);
+    }
+  else if (!d)
+    {
+      /*
+       *  If we get another event for a device we do not know, the "add" event might have been lost.
+       *  Even an "add" can be stale (or forged), so we add only devices which exist in sysfs.
+       */
+      char path[OBJNAMELEN];
+      d = sysfs_hotplug_add(a, dom, bus, dev, func);
+      sysfs_obj_name(d, ".", path);
+      if (access(path, F_OK))
+	{
+	  a->debug("sysfs: Device %s does not exist, ignoring\n", path);
+	  sysfs_hotplug_remove(a, d);
+	  return 0;
+	}
+    }
+  else
+    sysfs_hotplug_reset(d);
+  return 1;
+}
+
+static int
+sysfs_resync(struct pci_access *a, int reset_all)
+{
+  struct sysfs_access *sa = a->backend_data;
+  char dirname[1024];
+  DIR *dir;
+  struct dirent *entry;
+  struct pci_dev *d, **gone;
+  unsigned int dom, bus, dev, func, i;
+  byte *seen;
+  int n, changed = 0, ngone = 0;
+
+  n = snprintf(dirname, sizeof(dirname), "%s/devices", sysfs_name(a));
+  if (n < 0 || n >= (int) sizeof(dirname))
+    a->error("Directory name too long");
+  dir = opendir(dirname);
+  if (!dir)
+    a->error("Cannot open %s", dirname);
+
+  sysfs_drop_index(a);
+  sysfs_build_index(a);
+  seen = pci_malloc(a, sa->index_size);
+  memset(seen, 0, sa->index_size);
+
+  while (entry = readdir(dir))
+    {
+      if (entry->d_name[0] == '.')
+	continue;
+      if (sscanf(entry->d_name, "%x:%x:%x.%d", &dom, &bus, &dev, &func) < 4 || dom > 0x7fffffff)
+	continue;
+      i = sysfs_index_find(sa, dom, bus, dev, func);
+      if (sa->index[i])
+	seen[i] = 1;
+      else
+	{
+	  /* Linking to the list does not disturb the index */
+	  d = pci_get_dev(a, dom, bus, dev, func);
+	  pci_link_dev(a, d);
+	  changed++;
+	}
+    }
+  closedir(dir);
+
+  gone = pci_malloc(a, sa->index_size * sizeof(struct pci_dev *));
+  for (i=0; i < (unsigned int) sa->index_size; i++)
+    if (sa->index[i])
+      {
+	if (!seen[i])
+	  gone[ngone++] = sa->index[i];
+	else if (reset_all)
+	  {
+	    sysfs_hotplug_reset(sa->index[i]);
+	    changed++;
+	  }
+      }
+  pci_mfree(seen);
+
+  for (i=0; i < (unsigned int) ngone; i++)
+    sysfs_hotplug_remove(a, gone[i]);
+  pci_mfree(gone);
+  sysfs_drop_index(a);
+
+  a->debug("sysfs: Resynced the list of devices, %d changes\n", changed + ngone);
+  return changed + ngone;
+}
+
+static int
+sysfs_rescan(struct pci_access *a)
+{
+  struct sysfs_access *sa = a->backend_data;
+  char buf[8192];
+  struct sockaddr_nl addr;
+  struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+  struct msghdr mh = { .msg_name = &addr, .msg_namelen = sizeof(addr), .msg_iov = &iov, .msg_iovlen = 1 };
+  int n, changed = 0;
+
+  if (sa->uevent_fd < 0)
+    return sysfs_resync(a, 0);
+
+  for (;;)
+    {
+      n = recvmsg(sa->uevent_fd, &mh, 0);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == ENOBUFS)
+	    {
+	      /* Some events were lost, so we do not know what changed */
+	      a->debug("sysfs: uevent socket overflow\n");
+	      return changed + sysfs_resync(a, 1);
+	    }
+	  if (errno != EAGAIN)
+	    a->warning("sysfs: Cannot receive uevent: %s", strerror(errno));
+	  break;
+	}
+      /* Accept only complete messages coming from the kernel */
+      if (addr.nl_pid || (mh.msg_flags & MSG_TRUNC))
+	continue;
+      changed += sysfs_hotplug_event(a, buf, n);
+    }
+  return changed;
 }
 
 struct pci_methods pm_linux_sysfs = {
@@ -618,4 +2258,13 @@ struct pci_methods pm_linux_sysfs = {
   .write = sysfs_write,
   .read_vpd = sysfs_read_vpd,
   .cleanup_dev = sysfs_cleanup_dev,
+  .hotplug_open = sysfs_hotplug_open,
+  .rescan = sysfs_rescan,
+  .hotplug_event = sysfs_hotplug_event,
+#ifdef PCI_HAVE_IO_URING
+  .read_blocks = sysfs_read_blocks,
+#endif
+#ifdef PCI_HAVE_PTHREADS
+  .prefetch_info = sysfs_prefetch_info,
+#endif
 };
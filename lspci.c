@@ -115,8 +115,8 @@ config_fetch(struct device *d, unsigned int pos, unsigned int len)
   return result;
 }
 
-struct device *
-scan_device(struct pci_dev *p)
+static struct device *
+alloc_device(struct pci_dev *p)
 {
   struct device *d;
 
@@ -132,7 +132,16 @@ scan_device(struct pci_dev *p)
   d->config = xmalloc(64);
   d->present = xmalloc(64);
   memset(d->present, 1, 64);
-  if (!d->no_config_access && !pci_read_block(p, 0, d->config, 64))
+  return d;
+}
+
+/* Called once the first 64 bytes of config space have been read (or failed to) */
+static void
+finish_device(struct device *d, int config_ok)
+{
+  struct pci_dev *p = d->dev;
+
+  if (!d->no_config_access && !config_ok)
     {
       d->no_config_access = 1;
       d->config_cached = d->config_bufsize = 0;
@@ -146,23 +155,71 @@ scan_device(struct pci_dev *p)
 	d->config_cached += 64;
     }
   pci_setup_cache(p, d->config, d->config_cached);
-  pci_fill_info(p, PCI_FILL_IDENT | PCI_FILL_CLASS | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | (need_topology ? PCI_FILL_PARENT : 0));
+}
+
+#define SCAN_FILL_FLAGS (PCI_FILL_IDENT | PCI_FILL_CLASS | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | (need_topology ? PCI_FILL_PARENT : 0))
+
+struct device *
+scan_device(struct pci_dev *p)
+{
+  struct device *d = alloc_device(p);
+
+  if (d)
+    {
+      finish_device(d, !d->no_config_access && pci_read_block(p, 0, d->config, 64));
+      pci_fill_info(p, SCAN_FILL_FLAGS);
+    }
   return d;
 }
 
 static void
 scan_devices(void)
 {
-  struct device *d;
-  struct pci_dev *p;
+  struct device **devs, *d;
+  struct pci_read_request *req;
+  struct pci_dev *p, **pdevs;
+  int i, n, nreq, ok;
 
   pci_scan_bus(pacc);
+
+  /* Read the standard headers of all devices in a single batch */
+  n = 0;
   for (p=pacc->devices; p; p=p->next)
-    if (d = scan_device(p))
+    n++;
+  devs = xmalloc(n * sizeof(struct device *) + 1);
+  req = xmalloc(n * sizeof(struct pci_read_request) + 1);
+  n = nreq = 0;
+  for (p=pacc->devices; p; p=p->next)
+    if (d = alloc_device(p))
       {
-	d->next = first_dev;
-	first_dev = d;
+	devs[n++] = d;
+	if (!d->no_config_access)
+	  {
+	    req[nreq].dev = p;
+	    req[nreq].pos = 0;
+	    req[nreq].buf = d->config;
+	    req[nreq].len = 64;
+	    nreq++;
+	  }
       }
+  pci_read_blocks(pacc, req, nreq);
+
+  for (i=nreq=0; i<n; i++)
+    {
+      d = devs[i];
+      ok = d->no_config_access ? 0 : req[nreq++].status;
+      finish_device(d, ok);
+      d->next = first_dev;
+      first_dev = d;
+    }
+
+  pdevs = xmalloc(n * sizeof(struct pci_dev *) + 1);
+  for (i=0; i<n; i++)
+    pdevs[i] = devs[i]->dev;
+  pci_prefetch_info(pacc, pdevs, n, SCAN_FILL_FLAGS);
+  free(pdevs);
+  free(req);
+  free(devs);
 }
 
 /*** Config space accesses ***/
@@ -253,6 +310,73 @@ sort_them(void)
   *last_dev = NULL;
 }
 
+/*** Resolving of names ***/
+
+/*
+ *  Look up names of all devices we are going to show at once, so that
+ *  the library can ask HWDB and DNS in batches. With -n, the library
+ *  does nothing and the tree shows names only in verbose mode.
+ */
+static void
+prefetch_names(void)
+{
+  struct pci_dev **index, **h;
+  int cnt;
+  struct device *d;
+
+  if (opt_tree && !verbose)
+    return;
+
+  cnt = 0;
+  for (d=first_dev; d; d=d->next)
+    cnt++;
+  h = index = alloca(sizeof(struct pci_dev *) * cnt);
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&gfilter, d->dev))
+      *h++ = d->dev;
+  pci_lookup_prefetch(pacc, 0, index, h - index);
+}
+
+/*** Fetching of device information ***/
+
+/* Fill in everything show_device() is going to ask for, so that it can be done in parallel */
+static void
+prefetch_info(void)
+{
+  struct pci_dev **index, **h;
+  struct device *d;
+  int flags = 0, cnt;
+
+  if (opt_machine)
+    {
+      if (verbose)
+	flags |= PCI_FILL_PHYS_SLOT | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP;
+      if (opt_kernel)
+	flags |= PCI_FILL_DRIVER;
+    }
+  else
+    {
+      if (verbose)
+	flags |= PCI_FILL_IRQ | PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES |
+	  PCI_FILL_PHYS_SLOT | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP |
+	  PCI_FILL_BRIDGE_BASES | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | PCI_FILL_RCD_LNK;
+      if (verbose || opt_kernel)
+	flags |= PCI_FILL_LABEL | PCI_FILL_DRIVER;
+    }
+  if (!flags)
+    return;
+
+  cnt = 0;
+  for (d=first_dev; d; d=d->next)
+    cnt++;
+  h = index = xmalloc(sizeof(struct pci_dev *) * cnt + 1);
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&gfilter, d->dev))
+      *h++ = d->dev;
+  pci_prefetch_info(pacc, index, h - index, flags);
+  free(index);
+}
+
 /*** Normal output ***/
 
 static void
@@ -1217,12 +1341,16 @@ main(int argc, char **argv)
     {
       scan_devices();
       sort_them();
+      prefetch_names();
       if (need_topology)
 	grow_tree();
       if (opt_tree)
 	show_forest(opt_filter ? &gfilter : NULL);
       else
-	show();
+	{
+	  prefetch_info();
+	  show();
+	}
     }
   show_kernel_cleanup();
   pci_cleanup(pacc);
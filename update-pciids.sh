@@ -5,6 +5,7 @@ set -e
 SRC="https://pci-ids.ucw.cz/v2.2/pci.ids"
 DEST=pci.ids
 PCI_COMPRESSED_IDS=
+COMPILE=compile-pciids
 GREP=grep
 VERSION=unknown
 USER_AGENT=update-pciids/$VERSION
@@ -88,6 +89,14 @@ else
 	rm -f $DEST.new
 fi
 
+# Replace the compiled copy of the list used by libpci
+rm -f ${DEST%.gz}.bin
+if command -v $COMPILE >/dev/null 2>&1 ; then
+	if ! $COMPILE -i $DEST ; then
+		echo >&2 "update-pciids: cannot create compiled copy of the list"
+	fi
+fi
+
 # Older versions did not compress the ids file, so let's make sure we
 # clean that up.
 if [ ${DEST%.gz} != ${DEST} ] ; then